@@ -1,11 +1,12 @@
 #define NOB_IMPLEMENTATION
 #define NOB_STRIP_PREFIX
 #include "nob.h"
+#include <math.h>
 #define get_arg(argv, argc) (argc > 0? shift(argv, argc) : "")
 #define NO_COMMAND NULL
 
 #define COMPILER "clang++"
-#define COMMON_FLAGS "-O1"
+#define COMMON_FLAGS "-O1", "-pthread"
 #define WARNING_FLAGS "-Wall", "-Wextra", \
     "-Wno-unused-const-variable", "-Wno-writable-strings", \
     "-Wno-vla-cxx-extension"
@@ -14,6 +15,13 @@
 #define SOURCE "source/main.cpp"
 #define EXE "algraph.exe"
 
+#define TESTS_DIR "tests"
+#define TESTS_BUILD_DIR "build/tests"
+#define TEST_COMPILER "clang"
+// The generated C has to round exactly like the interpreter, so the C compiler
+// must not fuse a * b + c into one instruction
+#define TEST_FLAGS "-std=c99", "-O1", "-ffp-contract=off", "-Wall", "-Wextra", "-Werror"
+
 bool compile(bool in_debug) {
     Cmd cmd = {0};
 
@@ -46,12 +54,322 @@ bool compile_and_run(bool in_debug) {
     return cmd_run_sync_and_reset(&cmd);
 }
 
+typedef struct {
+    double *items;
+    size_t count;
+    size_t capacity;
+} Doubles;
+
+/* Compares the printed Outports line by line, the names exactly and the values
+ * bit for bit, or within the relative `tolerance` if it isn't 0. With `lsbs`
+ * the tolerance is absolute instead, that many of the Outport's lsbs. NaNs are
+ * all the same. */
+bool outputs_match(const char *what, const char *got_path, const char *expected_path, double tolerance,
+                   const Doubles *lsbs) {
+    String_Builder got = {0};
+    String_Builder expected = {0};
+    bool match = read_entire_file(got_path, &got) && read_entire_file(expected_path, &expected);
+    sb_append_null(&got);
+    sb_append_null(&expected);
+
+    char *g = got.items;
+    char *e = expected.items;
+    size_t g_header = strcspn(g, "\n");
+    size_t e_header = strcspn(e, "\n");
+    if (match && (g_header != e_header || memcmp(g, e, g_header) != 0)) {
+        nob_log(ERROR, "%s: the Outports are '%.*s', expected '%.*s'", what,
+                (int)g_header, g, (int)e_header, e);
+        match = false;
+    }
+    g += g_header;
+    e += e_header;
+    for (int line = 2; match && *e != '\0'; line++) {
+        if (*g == '\0') {
+            nob_log(ERROR, "%s: the output ends before line %d", what, line);
+            match = false;
+            break;
+        }
+        g++;
+        e++;
+        for (size_t column = 0; match && *e != '\n' && *e != '\0'; column++) {
+            char *g_end, *e_end;
+            double g_value = strtod(g, &g_end);
+            double e_value = strtod(e, &e_end);
+            // Relative to the larger value, and absolute below 1. Without libm,
+            // nob rebuilds itself without linking it
+            double difference = g_value > e_value? g_value - e_value : e_value - g_value;
+            double scale = 1;
+            if (g_value > scale || -g_value > scale) scale = g_value > 0? g_value : -g_value;
+            if (e_value > scale || -e_value > scale) scale = e_value > 0? e_value : -e_value;
+            if (lsbs) scale = column < lsbs->count? lsbs->items[column] : 0;
+            bool same = g_end != g && e_end != e &&
+                        (memcmp(&g_value, &e_value, sizeof(double)) == 0 || (isnan(g_value) && isnan(e_value)) ||
+                         (tolerance != 0 && difference <= tolerance * scale));
+            if (!same) {
+                nob_log(ERROR, "%s: line %d has %.*s, expected %.*s", what, line,
+                        (int)strcspn(g, " \n"), g, (int)strcspn(e, " \n"), e);
+                match = false;
+            }
+            g = g_end + strspn(g_end, " ");
+            e = e_end + strspn(e_end, " ");
+        }
+        if (match && *g != '\n' && *g != '\0') {
+            nob_log(ERROR, "%s: line %d has more values than expected", what, line);
+            match = false;
+        }
+    }
+    if (match && *g != '\0') {
+        nob_log(ERROR, "%s: the output has more lines than expected", what);
+        match = false;
+    }
+
+    free(got.items);
+    free(expected.items);
+    return match;
+}
+
+int count_lines(const char *path) {
+    String_Builder text = {0};
+    if (!read_entire_file(path, &text)) return -1;
+    int lines = 0;
+    for (size_t i = 0; i < text.count; i++) lines += text.items[i] == '\n';
+    free(text.items);
+    return lines;
+}
+
+/* Without an `output_path` the output isn't redirected. */
+bool run_with_input(Cmd *cmd, const char *input_path, const char *output_path) {
+    Fd fdin = fd_open_for_read(input_path);
+    if (fdin == INVALID_FD) return false;
+    if (output_path == NULL) return cmd_run_sync_redirect_and_reset(cmd, (Cmd_Redirect) {.fdin = &fdin});
+    Fd fdout = fd_open_for_write(output_path);
+    if (fdout == INVALID_FD) {
+        fd_close(fdin);
+        return false;
+    }
+    return cmd_run_sync_redirect_and_reset(cmd, (Cmd_Redirect) {.fdin = &fdin, .fdout = &fdout});
+}
+
+/* Reads the Outports' lsbs that a --fixed-point program prints with `lsb`. */
+bool read_lsbs(const char *path, Doubles *lsbs) {
+    String_Builder text = {0};
+    if (!read_entire_file(path, &text)) return false;
+    sb_append_null(&text);
+    char *end;
+    for (char *p = text.items; ; p = end) {
+        double lsb = strtod(p, &end);
+        if (end == p) break;
+        da_append(lsbs, lsb);
+    }
+    free(text.items);
+    return true;
+}
+
+/* Appends a --range for each `LO HI NAME` line of `path`, the name is the
+ * rest of the line. */
+bool append_ranges(Cmd *cmd, const char *path) {
+    String_Builder text = {0};
+    if (!read_entire_file(path, &text)) return false;
+    String_View rest = sb_to_sv(text);
+    bool ok = true;
+    for (int line = 1; rest.count > 0; line++) {
+        String_View range = sv_trim(sv_chop_by_delim(&rest, '\n'));
+        if (range.count == 0) continue;
+        String_View lo = sv_chop_by_delim(&range, ' ');
+        String_View hi = sv_chop_by_delim(&range, ' ');
+        String_View name = sv_trim(range);
+        if (name.count == 0) {
+            nob_log(ERROR, "%s:%d: expected LO HI NAME", path, line);
+            ok = false;
+            break;
+        }
+        cmd_append(cmd, "--range", temp_sv_to_cstr(name), temp_sv_to_cstr(lo), temp_sv_to_cstr(hi));
+    }
+    free(text.items);
+    return ok;
+}
+
+typedef struct {
+    const char *option;    // for algraph, NULL for none
+    const char *argument;  // of the option, NULL if it has none
+    const char *suffix;    // of the expected output, NAME.out if the model has no NAME.suffix
+    double tolerance;      // how far from the expected output it may be, 0 for bit for bit
+    bool only_c;           // the option only changes the C, the simulations run without it
+    const char *driver;    // defined for nwocg_run.c, which then includes the generated header
+    const char *last;      // with --batch, the last instance, checked after instance 0
+    bool fixed;            // --fixed-point with NAME.ranges, only C, the tolerance in lsbs
+} Test_Options;
+
+Test_Options test_options[] = {
+    { NULL,          NULL, ".out",       0,     false, NULL,                  NULL, false },
+    // Unoptimized code rounds exactly like the optimized one
+    { "-O0",         NULL, ".out",       0,     false, NULL,                  NULL, false },
+    // Reassociated sums round differently, but the same in C and simulated
+    { "--fast-math", NULL, ".out",       1e-12, false, NULL,                  NULL, false },
+    { "--float",     NULL, ".float.out", 0,     false, NULL,                  NULL, false },
+    { "--reentrant", NULL, ".out",       0,     true,  "NWOCG_RUN_REENTRANT", NULL, false },
+    // Not a multiple of CODEGEN_LANES, the last group is partial
+    { "--batch",     "70", ".out",       0,     true,  "NWOCG_RUN_BATCH",     "69", false },
+    // The inputs and each block round to the nearest value of their formats,
+    // which stays within an lsb of the Outports, truncating doesn't
+    { NULL,          NULL, ".fixed.out", 1,     true,  "NWOCG_RUN_FIXED",     NULL, true },
+    // Where a model overflows, NAME.wrap.out has it wrapping instead of saturating
+    { "--wrap",      NULL, ".wrap.out",  1,     true,  "NWOCG_RUN_FIXED",     NULL, true },
+};
+
+static bool append_option(Cmd *cmd, Test_Options options, const char *ranges, bool simulated) {
+    if (options.fixed && !simulated) {
+        cmd_append(cmd, "--fixed-point");
+        if (!append_ranges(cmd, ranges)) return false;
+    }
+    if (options.option == NULL || (simulated && options.only_c)) return true;
+    cmd_append(cmd, options.option);
+    if (options.argument) cmd_append(cmd, options.argument);
+    return true;
+}
+
+/* Runs a model with one set of options. It's piped into algraph and compiled
+ * to C, built with nwocg_run.c and run on the inputs, and simulated in the
+ * interpreter and the JIT. The interpreter has to print the expected values,
+ * the C and the JIT exactly what the interpreter did. --fixed-point has no
+ * simulation, its C is checked against the expected values. */
+bool test_model_with(const char *name, Test_Options options, size_t index) {
+    const char *model = temp_sprintf(TESTS_DIR"/%s.xml", name);
+    const char *input = temp_sprintf(TESTS_DIR"/%s.in", name);
+    const char *ranges = temp_sprintf(TESTS_DIR"/%s.ranges", name);
+    if (options.fixed && file_exists(ranges) != 1) return true;
+    const char *expected = temp_sprintf(TESTS_DIR"/%s%s", name, options.suffix);
+    if (file_exists(expected) != 1) expected = temp_sprintf(TESTS_DIR"/%s.out", name);
+    int lines = count_lines(expected);
+    if (lines < 2) {
+        nob_log(ERROR, "%s needs the Outports and at least one step", expected);
+        return false;
+    }
+    const char *steps = temp_sprintf("%d", lines - 1);
+    const char *option = options.option? options.option : options.fixed? "--fixed-point" : "default";
+
+    const char *code = temp_sprintf(TESTS_BUILD_DIR"/%s.%zu.c", name, index);
+    const char *program = temp_sprintf(TESTS_BUILD_DIR"/%s.%zu", name, index);
+    const char *from_c = temp_sprintf(TESTS_BUILD_DIR"/%s.%zu.c.out", name, index);
+    const char *from_simulate = temp_sprintf(TESTS_BUILD_DIR"/%s.%zu.simulate.out", name, index);
+
+    Cmd cmd = {0};
+    bool passed = true;
+
+    if (!options.fixed) {
+        cmd_append(&cmd, "./"EXE, "--simulate", steps);
+        append_option(&cmd, options, ranges, /*simulated*/true);
+        cmd_append(&cmd, model);
+        passed &= run_with_input(&cmd, input, from_simulate) &&
+                  outputs_match(temp_sprintf("%s %s --simulate", name, option), from_simulate, expected,
+                                options.tolerance, NULL);
+
+#if defined(__x86_64__) || defined(_M_X64)
+        const char *from_jit = temp_sprintf(TESTS_BUILD_DIR"/%s.%zu.jit.out", name, index);
+        cmd_append(&cmd, "./"EXE, "--simulate", steps, "--jit");
+        append_option(&cmd, options, ranges, /*simulated*/true);
+        cmd_append(&cmd, model);
+        passed &= run_with_input(&cmd, input, from_jit) &&
+                  outputs_match(temp_sprintf("%s %s --simulate --jit", name, option), from_jit, from_simulate, 0, NULL);
+#endif
+    }
+
+    cmd_append(&cmd, "./"EXE);
+    bool built = append_option(&cmd, options, ranges, /*simulated*/false);
+    cmd_append(&cmd, "-", code);
+    built = built && run_with_input(&cmd, model, NULL);
+    cmd.count = 0;
+    if (built) {
+        cmd_append(&cmd, TEST_COMPILER);
+        nob_cc_output(&cmd, program);
+        cmd_append(&cmd, TEST_FLAGS, "-I"TESTS_DIR);
+        if (options.driver) {
+            // algraph puts the header next to the code
+            cmd_append(&cmd, temp_sprintf("-D%s", options.driver), "-I"TESTS_BUILD_DIR,
+                       temp_sprintf("-DNWOCG_RUN_HEADER=\"%s.%zu.h\"", name, index));
+        }
+        cmd_append(&cmd, code, TESTS_DIR"/nwocg_run.c", "-lm");
+        built = cmd_run_sync_and_reset(&cmd);
+    }
+    if (built) {
+        cmd_append(&cmd, program, steps);
+        if (options.last) cmd_append(&cmd, "0");
+        built = run_with_input(&cmd, input, from_c);
+    }
+    if (options.fixed) {
+        const char *lsb = temp_sprintf(TESTS_BUILD_DIR"/%s.%zu.lsb", name, index);
+        Doubles lsbs = {0};
+        if (built) {
+            cmd_append(&cmd, program, "lsb");
+            built = run_with_input(&cmd, input, lsb) && read_lsbs(lsb, &lsbs);
+        }
+        passed &= built && outputs_match(temp_sprintf("%s %s C", name, option), from_c, expected,
+                                         options.tolerance, &lsbs);
+        da_free(lsbs);
+    } else {
+        passed &= built && outputs_match(temp_sprintf("%s %s C", name, option), from_c, from_simulate, 0, NULL);
+    }
+    if (built && options.last) {
+        const char *from_last = temp_sprintf(TESTS_BUILD_DIR"/%s.%zu.c.%s.out", name, index, options.last);
+        cmd_append(&cmd, program, steps, options.last);
+        passed &= run_with_input(&cmd, input, from_last) &&
+                  outputs_match(temp_sprintf("%s %s C instance %s", name, option, options.last),
+                                from_last, from_simulate, 0, NULL);
+    }
+
+    cmd_free(cmd);
+    return passed;
+}
+
+/* Every tests/NAME.xml is a model with the Inports of each step in NAME.in and
+ * the Outports it has to print in NAME.out, or NAME.float.out with --float,
+ * checked with each of the options. With NAME.ranges it's also compiled with
+ * --fixed-point, where NAME.fixed.out and NAME.wrap.out have what overflows. */
+bool test_model(const char *name) {
+    bool passed = true;
+    for (size_t i = 0; i < ARRAY_LEN(test_options); i++) {
+        passed &= test_model_with(name, test_options[i], i);
+    }
+    return passed;
+}
+
+bool test(void) {
+    if (!compile(/*in_debug*/false)) return false;
+    if (!mkdir_if_not_exists("build")) return false;
+    if (!mkdir_if_not_exists(TESTS_BUILD_DIR)) return false;
+
+    File_Paths files = {0};
+    if (!read_entire_dir(TESTS_DIR, &files)) return false;
+    int failed = 0;
+    int total = 0;
+    for (size_t i = 0; i < files.count; i++) {
+        String_View file = sv_from_cstr(files.items[i]);
+        if (!sv_end_with(file, ".xml")) continue;
+        const char *name = temp_sv_to_cstr(sv_from_parts(file.data, file.count - strlen(".xml")));
+        total++;
+        failed += !test_model(name);
+    }
+    da_free(files);
+
+    if (failed != 0) {
+        nob_log(ERROR, "%d of %d models failed", failed, total);
+        return false;
+    }
+    nob_log(INFO, "All %d models passed", total);
+    return true;
+}
+
 int help(char *program) {
     printf("\n");
     printf("Usage: %s [COMMAND]\n", program);
     printf("COMMAND:\n");
     printf("    help         show this message and exit\n");
     printf("    run          compile and run the program\n");
+    printf("    test         compile and check the models in "TESTS_DIR"/ against their\n");
+    printf("                 expected outputs, as C and simulated with and without\n");
+    printf("                 --jit, optimized, with -O0, --fast-math, --float,\n");
+    printf("                 --reentrant and --batch, and models with NAME.ranges\n");
+    printf("                 as --fixed-point C, saturating and with --wrap\n");
     printf("\n");
     printf("The default action is to just compile the program\n");
     return 0;
@@ -69,6 +387,8 @@ int main(int argc, char **argv) {
         if (!compile_and_run(/*in_debug*/false)) return 1;
     } else if (strcmp(target, "debug") == 0) {
         if (!compile_and_run(/*in_debug*/true)) return 1;
+    } else if (strcmp(target, "test") == 0) {
+        if (!test()) return 1;
     } else {
         return help(program);
     }
@@ -0,0 +1,160 @@
+/*
+ * arena.hpp - bump allocator for things that die together.
+ *
+ * Allocation is a pointer bump, freeing is done for the whole arena at once
+ * or back to a mark taken earlier (for per-phase or per-element scratch).
+ * Blocks released by a reset are kept around and reused.
+ *
+ * Memory from an arena must never be passed to free/realloc,
+ * so arrays grown with the arena variants must not be array_free'd.
+ */
+
+#ifndef ARENA_HPP
+#define ARENA_HPP
+
+#include <stddef.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <string.h>
+
+#include "types.h"
+#include "array.hpp"
+
+#define ARENA_DEFAULT_BLOCK_SIZE (64 * 1024)
+
+struct Arena_Block {
+    Arena_Block *prev;
+    u64 capacity;
+    u64 used;
+    alignas(16) char data[];
+};
+
+struct Arena {
+    Arena_Block *current = nullptr;
+    Arena_Block *unused = nullptr;  // released by resets, waiting for reuse
+    char *last = nullptr;           // start of the last allocation, it can grow in place
+};
+
+struct Arena_Mark {
+    Arena_Block *block;
+    u64 used;
+};
+
+static inline u64 arena_align_up(u64 value, u64 align) {
+    return (value + align - 1) & ~(align - 1);
+}
+
+static Arena_Block *arena_new_block(Arena *arena, u64 min_capacity) {
+    // Reuse the first unused block that is big enough
+    for (Arena_Block **it = &arena->unused; *it; it = &(*it)->prev) {
+        if ((*it)->capacity >= min_capacity) {
+            Arena_Block *block = *it;
+            *it = block->prev;
+            block->used = 0;
+            return block;
+        }
+    }
+
+    u64 capacity = ARENA_DEFAULT_BLOCK_SIZE;
+    while (capacity < min_capacity) capacity *= 2;
+
+    Arena_Block *block = (Arena_Block *)malloc(sizeof(Arena_Block) + capacity);
+    assert((block != NULL) && "Buy more RAM lol!");
+    block->capacity = capacity;
+    block->used = 0;
+    return block;
+}
+
+void *arena_alloc(Arena *arena, u64 size, u64 align = 16) {
+    Arena_Block *block = arena->current;
+    u64 start = block? arena_align_up(block->used, align) : 0;
+
+    if (block == nullptr || start + size > block->capacity) {
+        Arena_Block *fresh = arena_new_block(arena, size);
+        fresh->prev = block;
+        arena->current = block = fresh;
+        start = 0;
+    }
+
+    block->used = start + size;
+    arena->last = block->data + start;
+    return arena->last;
+}
+
+/* Grows the last allocation in place when possible, copies otherwise. */
+void *arena_realloc(Arena *arena, void *old, u64 old_size, u64 new_size, u64 align = 16) {
+    Arena_Block *block = arena->current;
+    if (old != nullptr && old == arena->last) {
+        u64 start = (char *)old - block->data;
+        if (start + new_size <= block->capacity) {
+            block->used = start + new_size;
+            return old;
+        }
+    }
+
+    void *fresh = arena_alloc(arena, new_size, align);
+    if (old != nullptr) memcpy(fresh, old, old_size < new_size? old_size : new_size);
+    return fresh;
+}
+
+template <typename T>
+T *arena_new(Arena *arena, u64 count = 1) {
+    return (T *)arena_alloc(arena, count * sizeof(T), alignof(T));
+}
+
+Arena_Mark arena_mark(Arena *arena) {
+    return (Arena_Mark){arena->current, arena->current? arena->current->used : 0};
+}
+
+/* Releases everything allocated after the mark was taken. */
+void arena_reset(Arena *arena, Arena_Mark mark) {
+    while (arena->current != mark.block) {
+        Arena_Block *block = arena->current;
+        arena->current = block->prev;
+        block->prev = arena->unused;
+        arena->unused = block;
+    }
+    if (arena->current) arena->current->used = mark.used;
+    arena->last = nullptr;
+}
+
+void arena_free(Arena *arena) {
+    arena_reset(arena, (Arena_Mark){nullptr, 0});
+    while (arena->unused) {
+        Arena_Block *block = arena->unused;
+        arena->unused = block->prev;
+        free(block);
+    }
+}
+
+/* Array growth inside an arena, same doubling as the malloc'ed versions. */
+
+template <typename T>
+void array_reserve_to_add(Array<T> *array, size_t added_length, Arena *arena) {
+    size_t required_length = array->length + added_length;
+    if (array->capacity >= required_length) return;
+
+    size_t new_capacity = array->capacity == 0 ? 8 : array->capacity;
+    while (new_capacity < required_length) {
+        new_capacity *= 2;
+    }
+    array->data = (T *)arena_realloc(arena, array->data, array->capacity * sizeof(T),
+                                     new_capacity * sizeof(T), alignof(T));
+    array->capacity = new_capacity;
+}
+
+template <typename T>
+void array_add(Array<T> *array, T element, Arena *arena) {
+    array_reserve_to_add(array, 1, arena);
+    array->data[array->length] = element;
+    array->length++;
+}
+
+template <typename T>
+void array_add_range(Array<T> *array, const T *elements, size_t count, Arena *arena) {
+    array_reserve_to_add(array, count, arena);
+    memcpy(array->data + array->length, elements, count * sizeof(T));
+    array->length += count;
+}
+
+#endif // ARENA_HPP
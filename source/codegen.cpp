@@ -0,0 +1,490 @@
+#pragma once
+
+/*
+ * codegen.cpp - the step program as C code for the nwocg runtime.
+ *
+ * What outlives a step is a member of one static struct, the temporaries
+ * are locals of `nwocg_generated_step` or nested right into their reader's
+ * expression (see storage.cpp). The step runs the ops in order and then
+ * updates the states. Inports and Outports are exposed through `ext_ports`,
+ * an Outport points at the value it shows.
+ *
+ * Single precision values are floats and their ops are float arithmetic:
+ * the literals are floats and a double operand is converted first, so
+ * nothing is promoted to double in between. Port values stay doubles, that
+ * is what the runtime reads and writes, a float result is exact in one.
+ *
+ * In batch mode there are `batch` instances of the model in groups of up to
+ * CODEGEN_LANES, in a group every member is an array over its instances
+ * (structure of arrays) and `nwocg_generated_step_batch` runs the step for
+ * the first `n` as a loop, one instance per iteration. The loop body is
+ * straight code over contiguous arrays, which compilers vectorize across
+ * instances on any target, twice as many at once over floats, and a group at
+ * a time stays in the cache however many instances there are. `ext_ports`
+ * point at instance 0, the others are found with `nwocg_generated_instance`.
+ * Both are declared in a header.
+ *
+ * The reentrant mode has no globals: the struct is the public type
+ * `nwocg_state`, the init and step functions take the instance to work on,
+ * and the ports are described by their offsets in it. Any number of
+ * instances can then be stepped from any threads, one thread per instance
+ * at a time. The declarations go into a header, or on top of the code.
+ */
+
+#include <math.h>
+#include <algorithm>
+
+#include "types.h"
+#include "array.hpp"
+#include "print.hpp"
+#include "hash_map.hpp"
+#include "program.cpp"
+#include "storage.cpp"
+
+#define CODEGEN_LANES 64
+
+struct Codegen_Options {
+    u32 max_depth;     // of nested expressions, 1 is a statement per op
+    bool reassociate;  // long Sums as balanced trees
+    u32 batch;         // instances in structure of arrays, 0 for one plain instance
+    bool reentrant;    // the state is passed in, see above
+    str header_name;   // reentrant and batch, the header to include, empty for none
+};
+
+struct Codegen {
+    Program *program;
+    Codegen_Options options;
+    Intern_Table *symbols;
+    Arena arena;              // names made up here
+    Storage storage;
+    Array<Symbol> names;      // by value, its member in the struct
+    Array<u8> in_float;       // by value, kept in a float, the others in doubles
+    str indent;               // of the statements in the step
+    Array<char> out;
+    Array<char> header;       // reentrant and batch
+};
+
+void codegen_free(Codegen *codegen) {
+    arena_free(&codegen->arena);
+    storage_free(&codegen->storage);
+    array_free(&codegen->names);
+    array_free(&codegen->in_float);
+    array_free(&codegen->out);
+    array_free(&codegen->header);
+}
+
+/* Identifiers a member can't have: the C99 keywords and the object-like macros
+ * of the headers the code includes. */
+static const char *codegen_reserved[] = {
+    "auto", "break", "case", "char", "const", "continue", "default", "do", "double", "else",
+    "enum", "extern", "float", "for", "goto", "if", "inline", "int", "long", "register",
+    "restrict", "return", "short", "signed", "sizeof", "static", "struct", "switch", "typedef",
+    "union", "unsigned", "void", "volatile", "while", "_Bool", "_Complex", "_Imaginary",
+    // <math.h>
+    "NAN", "INFINITY", "HUGE_VAL", "HUGE_VALF", "HUGE_VALL", "FP_NAN", "FP_INFINITE", "FP_ZERO",
+    "FP_SUBNORMAL", "FP_NORMAL", "FP_ILOGB0", "FP_ILOGBNAN", "MATH_ERRNO", "MATH_ERREXCEPT",
+    "math_errhandling",
+    // <stddef.h>
+    "NULL", "offsetof",
+    // <stdint.h>, for the fixed-point code
+    "INT8_MIN", "INT8_MAX", "INT16_MIN", "INT16_MAX", "INT32_MIN", "INT32_MAX", "INT64_MIN",
+    "INT64_MAX", "UINT8_MAX", "UINT16_MAX", "UINT32_MAX", "UINT64_MAX",
+};
+
+/* C identifiers for the members. Two names that mangle to the same one, or a
+ * name that is reserved in C, get the SID appended. */
+static void assign_names(Codegen *codegen) {
+    Program *program = codegen->program;
+    u32 value_count = program_value_count(program);
+
+    Hash_Map<Symbol, u8> taken = {};
+    hash_map_reserve(&taken, value_count + sizeof(codegen_reserved) / sizeof(codegen_reserved[0]));
+    for (const char *reserved : codegen_reserved) {
+        hash_map_get_or_add(&taken, intern(codegen->symbols, str_cstr_view((char *)reserved)), (u8)1);
+    }
+    array_reserve(&codegen->names, value_count);
+    for (Value v = 0; v < value_count; v++) {
+        if (codegen->storage.storage_class[v] != STORAGE_STATIC) {
+            array_add(&codegen->names, (Symbol)SYMBOL_NONE);
+            continue;
+        }
+        Symbol name = intern_c_identifier(codegen->symbols, program->value_name[v]);
+        bool added = false;
+        hash_map_get_or_add(&taken, name, (u8)1, &added);
+        while (!added) {
+            str suffixed = sprint_arena(&codegen->arena, "%_%", symbol_str(codegen->symbols, name), program->value_sid[v]);
+            name = intern(codegen->symbols, suffixed);
+            hash_map_get_or_add(&taken, name, (u8)1, &added);
+        }
+        array_add(&codegen->names, name);
+    }
+
+    hash_map_free(&taken);
+}
+
+static str value_name(Codegen *codegen, Value value) {
+    return symbol_str(codegen->symbols, codegen->names[value]);
+}
+
+/* Single precision values are floats, unless the runtime sees them through a port. */
+static void assign_types(Codegen *codegen) {
+    Program *program = codegen->program;
+    u32 value_count = program_value_count(program);
+    array_reserve(&codegen->in_float, value_count);
+    for (Value v = 0; v < value_count; v++) {
+        array_add(&codegen->in_float, (u8)(program->value_precision[v] == PRECISION_SINGLE));
+    }
+    for (Ext_Port &port : program->ports) codegen->in_float[port.value] = 0;
+}
+
+static str value_type(Codegen *codegen, Value value) {
+    return codegen->in_float[value]? str("float") : str("double");
+}
+
+/* `nwocg.member`, `group->member[i]` in batch mode, `nwocg->member` when
+ * reentrant, or the local slot `t3`. */
+static void emit_value(Codegen *codegen, Value value) {
+    if (codegen->storage.storage_class[value] == STORAGE_LOCAL) {
+        builder_print(&codegen->out, "t%", codegen->storage.slot[value]);
+    } else {
+        if (codegen->options.batch != 0) {
+            builder_print(&codegen->out, "group->%[i]", value_name(codegen, value));
+        } else if (codegen->options.reentrant) {
+            builder_print(&codegen->out, "nwocg->%", value_name(codegen, value));
+        } else {
+            builder_print(&codegen->out, "nwocg.%", value_name(codegen, value));
+        }
+    }
+}
+
+/* A floating literal of `precision`, with a point or an exponent, and the
+ * suffix if it's a float. */
+static void emit_number(Array<char> *out, f64 value, Precision precision) {
+    if (isnan(value)) {
+        builder_add(out, str("NAN"));
+    } else if (isinf(value)) {
+        builder_add(out, value < 0? str("-INFINITY") : str("INFINITY"));
+    } else {
+        // Never an integer constant, C reads "-0" as 0, which is +0
+        u64 start = out->length;
+        if (precision == PRECISION_SINGLE) builder_print(out, "%", (f32)value);
+        else builder_print(out, "%", value);
+        str digits = str_slice((str){out->data, out->length}, start, out->length);
+        bool has_point = false;
+        for (char c : digits) has_point |= c == '.' || c == 'e';
+        if (!has_point) builder_add(out, str(".0"));
+        if (precision == PRECISION_SINGLE) builder_add(out, str("f"));
+    }
+}
+
+static void emit_string_literal(Array<char> *out, str text) {
+    array_add(out, '"');
+    for (char c : text) {
+        if (c == '"' || c == '\\') {
+            array_add(out, '\\');
+            array_add(out, c);
+        } else if ((u8)c < 0x20 || (u8)c == 0x7F) {
+            char escape[4] = {'\\', (char)('0' + ((u8)c >> 6)), (char)('0' + (((u8)c >> 3) & 7)), (char)('0' + ((u8)c & 7))};
+            array_add_range(out, escape, 4);
+        } else {
+            array_add(out, c);
+        }
+    }
+    array_add(out, '"');
+}
+
+static void emit_expression(Codegen *codegen, Op *op);
+
+/* Item `item` of the op: the constant, then the terms. The first one of a sum is `leading`. */
+static void emit_item(Codegen *codegen, Op *op, u32 item, bool leading) {
+    Array<char> *out = &codegen->out;
+    Precision precision = (Precision)codegen->program->value_precision[op->result];
+    if (op->has_constant && item == 0) {
+        if (!leading) builder_add(out, str(" + "));
+        emit_number(out, op->constant, precision);
+        return;
+    }
+    Term term = op_terms(codegen->program, op)[item - op->has_constant];
+    // x * -k is -(x * k) exactly, so the sign can go in front
+    bool minus = signbit(term.scale) && !isnan(term.scale);
+    if (leading) {
+        if (minus) builder_add(out, str("-"));
+    } else {
+        builder_add(out, minus? str(" - ") : str(" + "));
+    }
+    // Operands are converted in the open, a double is rounded to float, a float promoted exactly
+    bool single = precision == PRECISION_SINGLE;
+    bool is_inline = codegen->storage.storage_class[term.value] == STORAGE_INLINE;
+    bool from_float = is_inline? codegen->program->value_precision[term.value] == PRECISION_SINGLE : codegen->in_float[term.value];
+    if (single != from_float) builder_add(out, single? str("(float)") : str("(double)"));
+    if (is_inline) {
+        builder_add(out, str("("));
+        emit_expression(codegen, &codegen->program->ops[codegen->storage.def[term.value]]);
+        builder_add(out, str(")"));
+    } else {
+        emit_value(codegen, term.value);
+    }
+    if (fabs(term.scale) != 1.0) {
+        builder_add(out, str(" * "));
+        emit_number(out, minus? -term.scale : term.scale, precision);
+    }
+}
+
+/* Items [first, end) added left to right, or as a balanced tree of halves
+ * so the additions don't wait on each other. */
+static void emit_sum(Codegen *codegen, Op *op, u32 first, u32 end) {
+    if (!codegen->options.reassociate || end - first <= 3) {
+        for (u32 item = first; item < end; item++) emit_item(codegen, op, item, item == first);
+        return;
+    }
+    u32 middle = first + (end - first) / 2;
+    builder_add(&codegen->out, str("("));
+    emit_sum(codegen, op, first, middle);
+    builder_add(&codegen->out, str(") + ("));
+    emit_sum(codegen, op, middle, end);
+    builder_add(&codegen->out, str(")"));
+}
+
+/* `constant + a * k - b + ...`, in the evaluation order of the op. */
+static void emit_expression(Codegen *codegen, Op *op) {
+    u32 item_count = op->has_constant + op->term_count;
+    if (item_count == 0) builder_add(&codegen->out, str("0"));
+    else emit_sum(codegen, op, 0, item_count);
+}
+
+static void emit_op(Codegen *codegen, Op *op) {
+    Array<char> *out = &codegen->out;
+    builder_add(out, codegen->indent);
+    emit_value(codegen, op->result);
+    builder_add(out, str(" = "));
+    emit_expression(codegen, op);
+    builder_add(out, str(";"));
+    // Which block a slot holds now
+    if (codegen->storage.storage_class[op->result] == STORAGE_LOCAL) {
+        Symbol block = intern_c_identifier(codegen->symbols, codegen->program->value_name[op->result]);
+        builder_print(out, "  /* % */", symbol_str(codegen->symbols, block));
+    }
+    builder_add(out, str("\n"));
+}
+
+static void emit_ext_ports(Codegen *codegen) {
+    Array<char> *out = &codegen->out;
+
+    builder_add(out, str("static const nwocg_ExtPort ext_ports[] =\n{\n"));
+    for (Ext_Port &port : codegen->program->ports) {
+        builder_add(out, str("    { "));
+        emit_string_literal(out, symbol_str(codegen->symbols, port.name));
+        if (codegen->options.batch != 0) {
+            builder_print(out, ", &nwocg[0].%[0], % },\n", value_name(codegen, port.value), (u32)port.is_input);
+        } else {
+            builder_print(out, ", &nwocg.%, % },\n", value_name(codegen, port.value), (u32)port.is_input);
+        }
+    }
+    builder_add(out, str("    { 0, 0, 0 },\n};\n\n"));
+    builder_add(out, str(
+        "const nwocg_ExtPort * const nwocg_generated_ext_ports      = ext_ports;\n"
+        "const size_t                nwocg_generated_ext_ports_size = sizeof(ext_ports);\n"));
+}
+
+/* The locals, the ops and the updates of one step. */
+static void emit_step_body(Codegen *codegen) {
+    Program *program = codegen->program;
+    Array<char> *out = &codegen->out;
+    str indent = codegen->indent;
+
+    // Doubles, then floats
+    for (u8 precision : {PRECISION_DOUBLE, PRECISION_SINGLE}) {
+        u32 declared = 0;
+        for (u32 slot = 0; slot < codegen->storage.slot_count; slot++) {
+            if (codegen->storage.slot_precision[slot] != precision) continue;
+            if (declared % 16 == 0) {
+                if (declared != 0) builder_add(out, str(";\n"));
+                builder_add(out, indent);
+                builder_print(out, "% t%", precision == PRECISION_SINGLE? str("float") : str("double"), slot);
+            } else {
+                builder_print(out, ", t%", slot);
+            }
+            declared++;
+        }
+        if (declared != 0) builder_add(out, str(";\n"));
+    }
+
+    for (Op &op : program->ops) {
+        if (codegen->storage.storage_class[op.result] != STORAGE_INLINE) emit_op(codegen, &op);
+    }
+    for (Update &update : program->updates) {
+        builder_add(out, indent);
+        emit_value(codegen, update.state);
+        builder_add(out, str(" = "));
+        if (codegen->in_float[update.state] && !codegen->in_float[update.source]) builder_add(out, str("(float)"));
+        emit_value(codegen, update.source);
+        builder_add(out, str(";\n"));
+    }
+}
+
+/* The declarations go into the header if there's one, or on top of the code. */
+static Array<char> *header_builder(Codegen *codegen) {
+    return codegen->options.header_name.length != 0? &codegen->header : &codegen->out;
+}
+
+static void emit_header_include(Codegen *codegen) {
+    Array<char> *out = &codegen->out;
+    if (codegen->options.header_name.length != 0) {
+        builder_add(out, str("#include "));
+        emit_string_literal(out, codegen->options.header_name);
+        builder_add(out, str("\n"));
+    } else {
+        builder_add(out, str("\n"));
+    }
+}
+
+static void emit_reentrant(Codegen *codegen) {
+    Program *program = codegen->program;
+    Array<char> *out = &codegen->out;
+    Array<char> *header = header_builder(codegen);
+
+    builder_add(header, str(
+        "#ifndef NWOCG_GENERATED_H\n#define NWOCG_GENERATED_H\n\n#include <stddef.h>\n\n"
+        "/* One instance of the model, instances share nothing. */\n"
+        "typedef struct nwocg_state\n{\n"));
+    for (Value v = 0; v < program_value_count(program); v++) {
+        if (codegen->storage.storage_class[v] == STORAGE_STATIC) {
+            builder_print(header, "    % %;\n", value_type(codegen, v), value_name(codegen, v));
+        }
+    }
+    builder_add(header, str(
+        "} nwocg_state;\n\n"
+        "typedef struct\n{\n"
+        "    const char *name;\n"
+        "    size_t offset;  /* of the value in nwocg_state */\n"
+        "    int is_input;\n"
+        "} nwocg_StatePort;\n\n"
+        "/* Sorted by name, ends with a null name. */\n"
+        "extern const nwocg_StatePort nwocg_generated_state_ports[];\n\n"
+        "void nwocg_generated_init_state(nwocg_state *restrict nwocg);\n"
+        "void nwocg_generated_step_state(nwocg_state *restrict nwocg);\n\n"
+        "#endif\n"));
+
+    emit_header_include(codegen);
+    builder_add(out, str("#include <math.h>\n\n"));
+
+    codegen->indent = str("    ");
+    // Without states there is nothing to set, and without ops nothing to step
+    builder_add(out, str("void nwocg_generated_init_state(nwocg_state *restrict nwocg)\n{\n"));
+    if (program->updates.length == 0) builder_add(out, str("    (void)nwocg;\n"));
+    for (Update &update : program->updates) {
+        builder_print(out, "    nwocg->% = ", value_name(codegen, update.state));
+        emit_number(out, program->value_initial[update.state], (Precision)program->value_precision[update.state]);
+        builder_add(out, str(";\n"));
+    }
+    builder_add(out, str("}\n\n"));
+
+    builder_add(out, str("void nwocg_generated_step_state(nwocg_state *restrict nwocg)\n{\n"));
+    u64 body = out->length;
+    emit_step_body(codegen);
+    if (out->length == body) builder_add(out, str("    (void)nwocg;\n"));
+    builder_add(out, str("}\n\n"));
+
+    builder_add(out, str("const nwocg_StatePort nwocg_generated_state_ports[] =\n{\n"));
+    for (Ext_Port &port : program->ports) {
+        builder_add(out, str("    { "));
+        emit_string_literal(out, symbol_str(codegen->symbols, port.name));
+        builder_print(out, ", offsetof(nwocg_state, %), % },\n", value_name(codegen, port.value), (u32)port.is_input);
+    }
+    builder_add(out, str("    { 0, 0, 0 },\n};\n"));
+}
+
+/* Emits the C translation unit into codegen->out, and the header into codegen->header if it has one. */
+void codegen_c(Codegen *codegen, Program *program, Intern_Table *symbols, Codegen_Options options) {
+    codegen->program = program;
+    codegen->symbols = symbols;
+    codegen->options = options;
+    storage_allocate(&codegen->storage, program, options.max_depth);
+    assign_names(codegen);
+    assign_types(codegen);
+
+    if (options.reentrant) {
+        emit_reentrant(codegen);
+        return;
+    }
+
+    Array<char> *out = &codegen->out;
+    u32 batch = options.batch;
+    if (batch != 0) {
+        Array<char> *header = header_builder(codegen);
+        builder_add(header, str(
+            "#ifndef NWOCG_GENERATED_H\n#define NWOCG_GENERATED_H\n\n#include \"nwocg_run.h\"\n\n"
+            "/* Instances of the model, ext_ports point at instance 0. */\n"
+            "extern const size_t nwocg_generated_batch;\n\n"
+            "/* Steps instances [0, n), n is at most nwocg_generated_batch. */\n"
+            "void nwocg_generated_step_batch(size_t n);\n"
+            "/* Where `instance` keeps the value of `port`. */\n"
+            "double *nwocg_generated_instance(const nwocg_ExtPort *port, size_t instance);\n\n"
+            "#endif\n"));
+        emit_header_include(codegen);
+        builder_add(out, str("#include <math.h>\n\n"));
+    } else {
+        builder_add(out, str("#include \"nwocg_run.h\"\n#include <math.h>\n\n"));
+    }
+    if (batch != 0) {
+        builder_print(out, "#define NWOCG_BATCH  %\n", batch);
+        builder_print(out, "#define NWOCG_LANES  %\n", std::min(batch, (u32)CODEGEN_LANES));
+        builder_add(out, str("#define NWOCG_GROUPS ((NWOCG_BATCH + NWOCG_LANES - 1) / NWOCG_LANES)\n\n"));
+        builder_add(out, str("const size_t nwocg_generated_batch = NWOCG_BATCH;\n\n"));
+    }
+
+    builder_add(out, batch != 0? str("static struct nwocg_group\n{\n") : str("static struct\n{\n"));
+    for (Value v = 0; v < program_value_count(program); v++) {
+        if (codegen->storage.storage_class[v] != STORAGE_STATIC) continue;
+        builder_print(out, "    % %", value_type(codegen, v), value_name(codegen, v));
+        builder_add(out, batch != 0? str("[NWOCG_LANES];\n") : str(";\n"));
+    }
+    builder_add(out, batch != 0? str("} nwocg[NWOCG_GROUPS];\n\n") : str("} nwocg;\n\n"));
+
+    builder_add(out, str("void nwocg_generated_init()\n{\n"));
+    codegen->indent = str("    ");
+    bool init_loop = batch != 0 && program->updates.length != 0;  // nothing to set without states
+    if (init_loop) {
+        builder_add(out, str(
+            "    for (size_t g = 0; g < NWOCG_GROUPS; g++) {\n"
+            "        struct nwocg_group *group = &nwocg[g];\n"
+            "        for (size_t i = 0; i < NWOCG_LANES; i++) {\n"));
+        codegen->indent = str("            ");
+    }
+    for (Update &update : program->updates) {
+        builder_add(out, codegen->indent);
+        emit_value(codegen, update.state);
+        builder_add(out, str(" = "));
+        emit_number(out, program->value_initial[update.state], (Precision)program->value_precision[update.state]);
+        builder_add(out, str(";\n"));
+    }
+    if (init_loop) builder_add(out, str("        }\n    }\n"));
+    builder_add(out, str("}\n\n"));
+
+    if (batch != 0) {
+        builder_add(out, str(
+            "/* Steps instances [0, n), n is at most NWOCG_BATCH. */\n"
+            "void nwocg_generated_step_batch(size_t n)\n{\n"
+            "    for (size_t first = 0; first < n; first += NWOCG_LANES) {\n"
+            "        struct nwocg_group *group = &nwocg[first / NWOCG_LANES];\n"
+            "        size_t lanes = n - first < NWOCG_LANES? n - first : NWOCG_LANES;\n"
+            "        for (size_t i = 0; i < lanes; i++) {\n"));
+        u64 body = out->length;
+        emit_step_body(codegen);
+        if (out->length == body) builder_add(out, str("            (void)group;\n"));  // no ops
+        builder_add(out, str("        }\n    }\n}\n\n"));
+        builder_add(out, str("void nwocg_generated_step()\n{\n    nwocg_generated_step_batch(NWOCG_BATCH);\n}\n\n"));
+        builder_add(out, str(
+            "/* Where `instance` keeps the value of `port`. */\n"
+            "double *nwocg_generated_instance(const nwocg_ExtPort *port, size_t instance)\n{\n"
+            "    size_t group_doubles = sizeof(nwocg[0]) / sizeof(double);  /* ports are doubles */\n"
+            "    return port->value + instance / NWOCG_LANES * group_doubles + instance % NWOCG_LANES;\n"
+            "}\n\n"));
+    } else {
+        builder_add(out, str("void nwocg_generated_step()\n{\n"));
+        emit_step_body(codegen);
+        builder_add(out, str("}\n\n"));
+    }
+
+    emit_ext_ports(codegen);
+}
@@ -0,0 +1,210 @@
+#pragma once
+
+/*
+ * codegen_fixed.cpp - the step program as integer C code, for targets without an FPU.
+ *
+ * Every value is an int32 in the format range.cpp chose for it. An op adds
+ * its terms in an int64 accumulator with a common number of fraction bits,
+ * up to FIXED_GUARD_BITS more than the result has if the terms have them and
+ * the range of the sum leaves room, and the sum is rounded into the result's
+ * format at the end. A single term is rounded into the result right away.
+ * A gain of a power of two is only a shift, any other one is a multiply by
+ * the gain as an integer with 30 significant bits. Shifts to the right round
+ * to nearest. A result outside of int32 saturates, or wraps around if asked.
+ *
+ * The struct and the step work like the floating-point ones (see codegen.cpp),
+ * ports are listed in `nwocg_generated_fixed_ports` with their fraction bits:
+ * the real value of a port is `*value * 2^-frac_bits`.
+ */
+
+#include <math.h>
+#include <algorithm>
+
+#include "types.h"
+#include "array.hpp"
+#include "print.hpp"
+#include "program.cpp"
+#include "range.cpp"
+#include "codegen.cpp"
+
+#define FIXED_GUARD_BITS 8
+// The accumulator keeps a bit above the sum's range for the rounding
+#define FIXED_ACCUMULATOR_BITS 62
+
+namespace codegen_fixed_detail {
+
+/* `(int64_t)x`, scaled by 2^shift. */
+static void emit_shifted(Codegen *codegen, Value value, s64 multiplier, s32 shift) {
+    Array<char> *out = &codegen->out;
+    shift = std::clamp(shift, (s32)-FIXED_ACCUMULATOR_BITS, (s32)FIXED_ACCUMULATOR_BITS);
+    if (shift > 0) builder_add(out, str("nwocg_shl("));
+    if (shift < 0) builder_add(out, str("nwocg_shr("));
+    builder_add(out, str("(int64_t)"));
+    emit_value(codegen, value);
+    if (multiplier != 1) builder_print(out, " * %", multiplier);
+    if (shift != 0) builder_print(out, ", %)", shift > 0? shift : -shift);
+}
+
+static void emit_fixed_op(Codegen *codegen, Fixed_Formats *formats, Op *op, bool wrap) {
+    Program *program = codegen->program;
+    Array<char> *out = &codegen->out;
+    Term *terms = op_terms(program, op);
+
+    // A term is value * multiplier with `natural` fraction bits, exactly
+    f64 sum = op->has_constant? fabs(op->constant) : 0;  // of the magnitudes
+    u32 item_count = op->has_constant;
+    s32 natural = formats->frac_bits[op->result];
+    auto split_gain = [](f64 scale, s64 *multiplier) {
+        int exponent;
+        f64 mantissa = frexp(fabs(scale), &exponent);
+        bool power_of_two = mantissa == 0.5;  // only a shift
+        s32 gain_bits = power_of_two? 1 - exponent : 30 - exponent;
+        *multiplier = power_of_two? 1 : (s64)llround(ldexp(fabs(scale), gain_bits));
+        return gain_bits;
+    };
+    for (u32 t = 0; t < op->term_count; t++) {
+        if (terms[t].scale == 0) continue;
+        s64 multiplier;
+        natural = std::max(natural, formats->frac_bits[terms[t].value] + split_gain(terms[t].scale, &multiplier));
+        sum += range_magnitude(formats->range[terms[t].value]) * fabs(terms[t].scale);
+        item_count++;
+    }
+
+    // Fraction bits of the accumulator: a single item is rounded once into the result,
+    // a sum gets the guard bits if its terms have them and its range leaves room
+    s32 result_bits = formats->frac_bits[op->result];
+    s32 bits = item_count > 1? std::min(natural, result_bits + FIXED_GUARD_BITS) : result_bits;
+    bits = std::min(bits, FIXED_ACCUMULATOR_BITS - range_exponent(sum));
+    bits = std::min(bits, (s32)FIXED_ACCUMULATOR_BITS);
+
+    builder_add(out, codegen->indent);
+    emit_value(codegen, op->result);
+    builder_add(out, wrap? str(" = nwocg_wrap(") : str(" = nwocg_sat("));
+    s32 final_shift = result_bits - bits;
+    if (final_shift > 0) builder_add(out, str("nwocg_shl("));
+    if (final_shift < 0) builder_add(out, str("nwocg_shr("));
+
+    bool first = true;
+    s64 constant = op->has_constant? (s64)llround(ldexp(op->constant, bits)) : 0;
+    if (constant != 0) {
+        builder_print(out, "INT64_C(%)", constant);
+        first = false;
+    }
+    for (u32 t = 0; t < op->term_count; t++) {
+        Value value = terms[t].value;
+        f64 scale = terms[t].scale;
+
+        // value * 2^-frac * k in the accumulator: value * multiplier * 2^shift
+        s64 multiplier = 0;
+        s32 shift = scale != 0? bits - formats->frac_bits[value] - split_gain(scale, &multiplier) : 0;
+        if (shift < -FIXED_ACCUMULATOR_BITS) {
+            // Below the resolution, still read like the term is so the value keeps its reader
+            multiplier = 0;
+            shift = 0;
+        }
+
+        if (first) {
+            if (scale < 0) builder_add(out, str("-"));
+        } else {
+            builder_add(out, scale < 0? str(" - ") : str(" + "));
+        }
+        emit_shifted(codegen, value, multiplier, shift);
+        first = false;
+    }
+    if (first) builder_add(out, str("0"));
+
+    if (final_shift != 0) builder_print(out, ", %)", final_shift > 0? final_shift : -final_shift);
+    builder_add(out, str(");"));
+    if (codegen->storage.storage_class[op->result] == STORAGE_LOCAL) {
+        Symbol block = intern_c_identifier(codegen->symbols, program->value_name[op->result]);
+        builder_print(out, "  /* % */", symbol_str(codegen->symbols, block));
+    }
+    builder_add(out, str("\n"));
+}
+
+/* Qm.n, m integer bits and n fraction bits next to the sign. */
+static void emit_format(Array<char> *out, s32 frac_bits) {
+    builder_print(out, "  /* Q%.% */", 31 - frac_bits, frac_bits);
+}
+
+} // namespace codegen_fixed_detail
+
+/* Emits the integer C translation unit into codegen->out. */
+void codegen_fixed(Codegen *codegen, Program *program, Intern_Table *symbols, Fixed_Formats *formats, bool wrap) {
+    using namespace codegen_fixed_detail;
+
+    codegen->program = program;
+    codegen->symbols = symbols;
+    codegen->indent = str("    ");
+    storage_allocate(&codegen->storage, program, /*max_depth*/1);
+    assign_names(codegen);
+
+    Array<char> *out = &codegen->out;
+    builder_add(out, str(
+        "#include <stdint.h>\n\n"
+        "/* Shifts by 0 < s < 63, to the right rounding to nearest.\n"
+        " * A right shift of a negative number is arithmetic on every target compiler. */\n"
+        "static inline int64_t nwocg_shl(int64_t x, int s) { return x * ((int64_t)1 << s); }\n"
+        "static inline int64_t nwocg_shr(int64_t x, int s) { return (x + ((int64_t)1 << (s - 1))) >> s; }\n"));
+    if (wrap) {
+        builder_add(out, str("static inline int32_t nwocg_wrap(int64_t x) { return (int32_t)(uint32_t)x; }\n\n"));
+    } else {
+        builder_add(out, str(
+            "static inline int32_t nwocg_sat(int64_t x) { return x > INT32_MAX? INT32_MAX : x < INT32_MIN? INT32_MIN : (int32_t)x; }\n\n"));
+    }
+    builder_add(out, str(
+        "/* The real value is *value * 2^-frac_bits. */\n"
+        "typedef struct\n{\n"
+        "    const char *name;\n"
+        "    int32_t *value;\n"
+        "    int frac_bits;\n"
+        "    int is_input;\n"
+        "} nwocg_FixedPort;\n\n"));
+
+    builder_add(out, str("static struct\n{\n"));
+    for (Value v = 0; v < program_value_count(program); v++) {
+        if (codegen->storage.storage_class[v] != STORAGE_STATIC) continue;
+        builder_print(out, "    int32_t %;", value_name(codegen, v));
+        emit_format(out, formats->frac_bits[v]);
+        builder_add(out, str("\n"));
+    }
+    builder_add(out, str("} nwocg;\n\n"));
+
+    builder_add(out, str("void nwocg_generated_init()\n{\n"));
+    for (Update &update : program->updates) {
+        f64 initial = ldexp(program->value_initial[update.state], formats->frac_bits[update.state]);
+        initial = fmin(fmax(round(initial), (f64)INT32_MIN), (f64)INT32_MAX);
+        builder_print(out, "    nwocg.% = %;\n", value_name(codegen, update.state), (s64)initial);
+    }
+    builder_add(out, str("}\n\n"));
+
+    builder_add(out, str("void nwocg_generated_step()\n{\n"));
+    for (u32 slot = 0; slot < codegen->storage.slot_count; slot++) {
+        if (slot % 16 == 0) {
+            if (slot != 0) builder_add(out, str(";\n"));
+            builder_print(out, "    int32_t t%", slot);
+        } else {
+            builder_print(out, ", t%", slot);
+        }
+    }
+    if (codegen->storage.slot_count != 0) builder_add(out, str(";\n"));
+    for (Op &op : program->ops) emit_fixed_op(codegen, formats, &op, wrap);
+    // States and their sources may be in different formats
+    for (Update &update : program->updates) {
+        builder_print(out, "    nwocg.% = ", value_name(codegen, update.state));
+        s32 shift = formats->frac_bits[update.state] - formats->frac_bits[update.source];
+        builder_add(out, wrap? str("nwocg_wrap(") : str("nwocg_sat("));
+        emit_shifted(codegen, update.source, 1, shift);
+        builder_add(out, str(");\n"));
+    }
+    builder_add(out, str("}\n\n"));
+
+    builder_add(out, str("static const nwocg_FixedPort fixed_ports[] =\n{\n"));
+    for (Ext_Port &port : program->ports) {
+        builder_add(out, str("    { "));
+        emit_string_literal(out, symbol_str(codegen->symbols, port.name));
+        builder_print(out, ", &nwocg.%, %, % },\n", value_name(codegen, port.value), formats->frac_bits[port.value], (u32)port.is_input);
+    }
+    builder_add(out, str("    { 0, 0, 0, 0 },\n};\n\n"));
+    builder_add(out, str("const nwocg_FixedPort * const nwocg_generated_fixed_ports = fixed_ports;\n"));
+}
@@ -0,0 +1,109 @@
+#pragma once
+
+/*
+ * dce.cpp - removal of everything the Outports don't depend on.
+ *
+ * The live values are the backward cone of the Outports: the values they
+ * show, the terms of the ops computing live values, and for a live state
+ * the source of its update, which is where the cone crosses to the previous
+ * step. Ops and states outside of it are removed, so a block feeding only
+ * a scope or a delay nobody reads costs nothing.
+ *
+ * Keeping only some of the Outports (program_select_outputs) before that
+ * slices the step down to just what they need. Inports are the interface
+ * of the runtime and are always kept.
+ */
+
+#include "types.h"
+#include "array.hpp"
+#include "program.cpp"
+
+struct Dce_Stats {
+    u32 ops;     // removed
+    u32 states;
+};
+
+/* Drops the Outports not named in `names`, an unknown name is an error. */
+Parsed program_select_outputs(Program *program, Intern_Table *symbols, Array<str> *names) {
+    Array<u8> found = {};  // by name
+    for (u64 n = 0; n < names->length; n++) array_add(&found, (u8)0);
+
+    u64 kept = 0;
+    for (Ext_Port &port : program->ports) {
+        bool selected = port.is_input;
+        for (u64 n = 0; n < names->length && !port.is_input; n++) {
+            if (symbol_str(symbols, port.name) == (*names)[n]) {
+                found[n] = 1;
+                selected = true;
+            }
+        }
+        if (selected) program->ports[kept++] = port;
+    }
+    program->ports.length = kept;
+
+    Parsed result = GOOD;
+    for (u64 n = 0; n < names->length; n++) {
+        if (found[n]) continue;
+        report_error("there is no Outport named %", (*names)[n]);
+        result = ERROR;
+    }
+    array_free(&found);
+    return result;
+}
+
+Dce_Stats eliminate_dead(Program *program) {
+    u32 value_count = program_value_count(program);
+    Array<u32> def = {};      // by value, the op or update computing it
+    Array<u8> live = {};      // by value
+    Array<Value> work = {};   // live values whose inputs aren't marked yet
+    array_reserve(&def, value_count);
+    array_reserve(&live, value_count);
+    for (Value v = 0; v < value_count; v++) {
+        array_add(&def, (u32)-1);
+        array_add(&live, (u8)0);
+    }
+    for (u32 i = 0; i < program->ops.length; i++) def[program->ops[i].result] = i;
+    for (u32 i = 0; i < program->updates.length; i++) def[program->updates[i].state] = i;
+
+    auto mark = [&](Value value) {
+        if (live[value]) return;
+        live[value] = 1;
+        array_add(&work, value);
+    };
+    for (Ext_Port &port : program->ports) {
+        if (!port.is_input) mark(port.value);
+    }
+    while (work.length != 0) {
+        Value value = work[work.length - 1];
+        work.length--;
+        if (def[value] == (u32)-1) continue;  // an input
+
+        if (program->value_kind[value] == VALUE_STATE) {
+            mark(program->updates[def[value]].source);
+            continue;
+        }
+        Op *op = &program->ops[def[value]];
+        Term *terms = op_terms(program, op);
+        for (u32 t = 0; t < op->term_count; t++) mark(terms[t].value);
+    }
+
+    Dce_Stats stats = {};
+    u32 kept = 0;
+    for (Op &op : program->ops) {
+        if (live[op.result]) program->ops[kept++] = op;
+    }
+    stats.ops = (u32)program->ops.length - kept;
+    program->ops.length = kept;
+
+    kept = 0;
+    for (Update &update : program->updates) {
+        if (live[update.state]) program->updates[kept++] = update;
+    }
+    stats.states = (u32)program->updates.length - kept;
+    program->updates.length = kept;
+
+    array_free(&def);
+    array_free(&live);
+    array_free(&work);
+    return stats;
+}
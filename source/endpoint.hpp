@@ -0,0 +1,95 @@
+/*
+ * endpoint.hpp - decoder for Line endpoints: "SID#out:N" and "SID#in:N".
+ *
+ * One pass over the bytes: SID digits, the direction tag checked with a single
+ * 4-byte compare, then port digits. Nothing is allocated and there is no
+ * general tokenizing, so it can be run over all Branch destinations in a batch.
+ */
+
+#ifndef ENDPOINT_HPP
+#define ENDPOINT_HPP
+
+#include <string.h>
+
+#include "types.h"
+#include "str.hpp"
+
+enum Endpoint_Direction : u8 {
+    ENDPOINT_OUT = 0,
+    ENDPOINT_IN  = 1,
+};
+
+struct Endpoint {
+    u32 sid;
+    u8 direction;  // Endpoint_Direction
+    u16 port;      // 1-based
+};
+
+namespace endpoint_detail {
+
+/* Reads up to `max_digits` decimal digits. Returns the number read. */
+static inline u32 read_digits(const char *p, const char *end, u32 max_digits, u64 *value) {
+    u64 result = 0;
+    u32 count = 0;
+    while (p + count < end && count < max_digits) {
+        u32 digit = (u8)p[count] - '0';
+        if (digit > 9) break;
+        result = result * 10 + digit;
+        count++;
+    }
+    *value = result;
+    return count;
+}
+
+static inline u32 load4(const char *p) {
+    u32 word;
+    memcpy(&word, p, sizeof(word));
+    return word;
+}
+
+static inline u32 tag4(const char *tag) {
+    return load4(tag);
+}
+
+} // namespace endpoint_detail
+
+/* Returns false if `text` is not exactly an endpoint. */
+inline bool endpoint_decode(str text, Endpoint *endpoint) {
+    using namespace endpoint_detail;
+
+    const char *p = text.data;
+    const char *end = text.data + text.length;
+
+    u64 sid;
+    u32 sid_digits = read_digits(p, end, 11, &sid);
+    p += sid_digits;
+
+    // "#in:" or "#out" followed by ':'
+    if (sid_digits == 0 || sid > 0xFFFFFFFFull || end - p < 5) return false;
+    u32 tag = load4(p);
+    bool is_in = tag == tag4("#in:");
+    bool is_out = tag == tag4("#out") && p[4] == ':';
+    if (!(is_in | is_out)) return false;
+    p += is_in? 4 : 5;
+
+    u64 port;
+    u32 port_digits = read_digits(p, end, 6, &port);
+    p += port_digits;
+    if (port_digits == 0 || p != end || port == 0 || port > 0xFFFF) return false;
+
+    endpoint->sid = (u32)sid;
+    endpoint->direction = is_in? ENDPOINT_IN : ENDPOINT_OUT;
+    endpoint->port = (u16)port;
+    return true;
+}
+
+/* Decodes `count` endpoints, e.g. all Dst's of a Line with its Branches.
+ * Returns the index of the first malformed one, or `count` if all are fine. */
+inline u64 endpoint_decode_batch(const str *texts, u64 count, Endpoint *endpoints) {
+    for (u64 i = 0; i < count; i++) {
+        if (!endpoint_decode(texts[i], &endpoints[i])) return i;
+    }
+    return count;
+}
+
+#endif // ENDPOINT_HPP
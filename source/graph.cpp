@@ -0,0 +1,354 @@
+#pragma once
+
+/*
+ * graph.cpp - the model lowered to a compressed sparse row graph.
+ *
+ * Blocks are dense u32 indices (the same as in Parser::blocks).
+ * Ports of all blocks are laid out back to back, so the inputs of block b
+ * are the slots [input_offsets[b], input_offsets[b + 1]), same for outputs.
+ * A signal is one output with everything it drives, its fan-out is
+ * [fanout_offsets[s], fanout_offsets[s + 1]) in fanout_inputs.
+ *
+ * Everything is a flat array, passes walk it front to back.
+ * Blocks are stored column-wise too, so a pass that only needs types and
+ * connectivity touches a few bytes per block. Numeric parameters of all
+ * blocks share one pool, geometry is kept apart as cold data.
+ *
+ * A block's OutDataTypeStr says in which precision its output is computed
+ * and kept, "double" or "single". "Inherit: ..." or none at all leaves it
+ * to the code generator. Inports and Outports are the runtime's doubles.
+ */
+
+#include "types.h"
+#include "array.hpp"
+#include "str_to_float.hpp"
+#include "parser.cpp"
+
+#define GRAPH_NONE ((u32)-1)
+
+/* [left, top, right, bottom] on the diagram */
+struct Position {
+    s32 left, top, right, bottom;
+};
+
+enum Precision : u8 {
+    PRECISION_DEFAULT,  // the one the code is generated with
+    PRECISION_DOUBLE,
+    PRECISION_SINGLE,
+};
+
+/* What each block keeps in the parameter pool:
+ *   IN_PORT, OUT_PORT  the port number
+ *   SUM                the sign of every input, +1 or -1
+ *   GAIN               the gain
+ *   DELAY              the initial condition
+ */
+struct Block_Columns {
+    Array<u8> type;              // Block_Type
+    Array<u32> sid;
+    Array<Symbol> name;
+    Array<u32> param_offsets;    // block_count + 1 of them, into param_pool
+    Array<f64> param_pool;
+    Array<u8> precision;         // Precision of the output
+    Array<Position> position;    // cold
+};
+
+struct Graph {
+    u32 block_count = 0;
+    u32 signal_count = 0;
+
+    Block_Columns blocks;
+
+    Array<u32> input_offsets;   // by block, block_count + 1 of them
+    Array<u32> output_offsets;  // by block, block_count + 1 of them
+
+    Array<u32> input_block;     // by input slot
+    Array<u32> input_signal;    // by input slot, the signal driving it
+    Array<u32> output_block;    // by output slot
+    Array<u32> output_signal;   // by output slot, GRAPH_NONE if it drives nothing
+
+    Array<u32> signal_output;   // by signal, the output slot behind it
+    Array<u32> fanout_offsets;  // by signal, signal_count + 1 of them
+    Array<u32> fanout_inputs;   // input slots
+};
+
+void graph_free(Graph *graph) {
+    array_free(&graph->blocks.type);
+    array_free(&graph->blocks.sid);
+    array_free(&graph->blocks.name);
+    array_free(&graph->blocks.param_offsets);
+    array_free(&graph->blocks.param_pool);
+    array_free(&graph->blocks.precision);
+    array_free(&graph->blocks.position);
+    array_free(&graph->input_offsets);
+    array_free(&graph->output_offsets);
+    array_free(&graph->input_block);
+    array_free(&graph->input_signal);
+    array_free(&graph->output_block);
+    array_free(&graph->output_signal);
+    array_free(&graph->signal_output);
+    array_free(&graph->fanout_offsets);
+    array_free(&graph->fanout_inputs);
+    *graph = (Graph){};
+}
+
+inline Block_Type graph_block_type(Graph *graph, u32 block) {
+    return (Block_Type)graph->blocks.type.data[block];
+}
+
+inline f64 *graph_params(Graph *graph, u32 block) {
+    return graph->blocks.param_pool.data + graph->blocks.param_offsets.data[block];
+}
+
+inline u32 graph_input_count(Graph *graph, u32 block) {
+    return graph->input_offsets.data[block + 1] - graph->input_offsets.data[block];
+}
+
+inline u32 graph_output_count(Graph *graph, u32 block) {
+    return graph->output_offsets.data[block + 1] - graph->output_offsets.data[block];
+}
+
+/* Signal driving the 0-based `input` of `block` */
+inline u32 graph_input_signal(Graph *graph, u32 block, u32 input) {
+    return graph->input_signal.data[graph->input_offsets.data[block] + input];
+}
+
+/* Block driving the input slot */
+inline u32 graph_driver(Graph *graph, u32 input_slot) {
+    u32 signal = graph->input_signal.data[input_slot];
+    return graph->output_block.data[graph->signal_output.data[signal]];
+}
+
+/* Can `block` only be computed after the driver of its `input_slot`?
+ * Not if either is a UnitDelay: its output is the state from the previous step,
+ * and its input is only needed to update the state at the end of the step. */
+inline bool graph_is_dependency(Graph *graph, u32 block, u32 input_slot) {
+    return graph_block_type(graph, block) != DELAY &&
+           graph_block_type(graph, graph_driver(graph, input_slot)) != DELAY;
+}
+
+/* "+-" or "|+-" give the signs, a plain number "3" means that many '+'.
+ * Missing Inputs means "++". */
+u32 sum_input_count(Block *block) {
+    Param *inputs = block_param(block, P_INPUTS);
+    if (inputs == NULL) return 2;
+
+    u32 count = 0;
+    if (str_to_int(inputs->value, &count) == S2I_OK) return count;
+
+    for (char c : inputs->value) {
+        count += c == '+' || c == '-';
+    }
+    return count;
+}
+
+u32 block_input_count(Block *block) {
+    switch (block->type) {
+    case IN_PORT:  return 0;
+    case SUM:      return sum_input_count(block);
+    case GAIN:     return 1;
+    case DELAY:    return 1;
+    case OUT_PORT: return 1;
+    case COUNT:    break;
+    }
+    assert(0 && "unreachable");
+    return 0;
+}
+
+u32 block_output_count(Block *block) {
+    return block->type == OUT_PORT? 0 : 1;
+}
+
+static str block_name(Parser *parser, u32 block) {
+    return symbol_str(parser->symbols, parser->blocks[block].name);
+}
+
+static Parsed param_to_float(Parser *parser, Block *block, Param_Key key, f64 missing, f64 *value) {
+    Param *param = block_param(block, key);
+    if (param == NULL) {
+        *value = missing;
+        return GOOD;
+    }
+    str text = param->value;
+    if (str_to_float_and_consume(&text, value) != S2F_OK ||
+        str_after_whitespace_strip(text.data, text.data + text.length) != text.data + text.length) {
+        report_error("% of block % must be a number, got '%'",
+                     param->name, symbol_str(parser->symbols, block->name), param->value);
+        return ERROR;
+    }
+    return GOOD;
+}
+
+static Parsed param_to_precision(Parser *parser, Block *block, Precision *precision) {
+    Param *param = block_param(block, P_OUT_DATA_TYPE);
+    *precision = PRECISION_DEFAULT;
+    if (param == NULL || str_startswith(param->value, str("Inherit"))) return GOOD;
+    if (param->value == str("double")) {
+        *precision = PRECISION_DOUBLE;
+    } else if (param->value == str("single")) {
+        *precision = PRECISION_SINGLE;
+    } else {
+        report_error("% of block % must be double, single or Inherit, got '%'",
+                     param->name, symbol_str(parser->symbols, block->name), param->value);
+        return ERROR;
+    }
+    return GOOD;
+}
+
+/* Moves the block records into columns and the parameter pool. */
+static Parsed build_block_columns(Graph *graph, Parser *parser) {
+    Block_Columns *columns = &graph->blocks;
+    u32 block_count = graph->block_count;
+    array_reserve(&columns->type, block_count);
+    array_reserve(&columns->sid, block_count);
+    array_reserve(&columns->name, block_count);
+    array_reserve(&columns->param_offsets, block_count + 1);
+    array_reserve(&columns->precision, block_count);
+    array_reserve(&columns->position, block_count);
+
+    Arena_Mark mark = arena_mark(&parser->arena);
+    for (u32 b = 0; b < block_count; b++) {
+        Block *block = &parser->blocks[b];
+        array_add(&columns->type, (u8)block->type);
+        array_add(&columns->sid, block->sid);
+        array_add(&columns->name, block->name);
+        array_add(&columns->param_offsets, (u32)columns->param_pool.length);
+
+        f64 value = 0;
+        switch (block->type) {
+        case IN_PORT:
+        case OUT_PORT:
+            if (param_to_float(parser, block, P_PORT, 1, &value)) return ERROR;
+            array_add(&columns->param_pool, value);
+            break;
+        case SUM: {
+            Param *inputs = block_param(block, P_INPUTS);
+            u32 count = sum_input_count(block);
+            bool numeric = inputs == NULL || str_to_int(inputs->value, &count) == S2I_OK;
+            for (u32 i = 0; i < count && numeric; i++) array_add(&columns->param_pool, 1.0);
+            if (!numeric) {
+                for (char c : inputs->value) {
+                    if (c == '+' || c == '-') array_add(&columns->param_pool, c == '+'? 1.0 : -1.0);
+                }
+            }
+        } break;
+        case GAIN:
+            if (param_to_float(parser, block, P_GAIN, 1, &value)) return ERROR;
+            array_add(&columns->param_pool, value);
+            break;
+        case DELAY:
+            if (param_to_float(parser, block, P_INITIAL_CONDITION, 0, &value)) return ERROR;
+            array_add(&columns->param_pool, value);
+            break;
+        case COUNT:
+            assert(0 && "unreachable");
+        }
+
+        Precision precision = PRECISION_DEFAULT;
+        if (param_to_precision(parser, block, &precision)) return ERROR;
+        array_add(&columns->precision, (u8)precision);
+
+        Position position = {0, 0, 0, 0};
+        Param *geometry = block_param(block, P_POSITION);
+        if (geometry) {
+            Array<f64> values = {};
+            u64 width = 0;
+            if (str_to_float_list(geometry->value, &values, &width, &parser->arena) == S2F_OK && values.length == 4) {
+                position = (Position){(s32)values[0], (s32)values[1], (s32)values[2], (s32)values[3]};
+            }
+            arena_reset(&parser->arena, mark);
+        }
+        array_add(&columns->position, position);
+    }
+    array_add(&columns->param_offsets, (u32)columns->param_pool.length);
+
+    return GOOD;
+}
+
+static void fill(Array<u32> *array, u64 length, u32 value) {
+    array_reserve(array, length);
+    array->length = length;
+    for (u64 i = 0; i < length; i++) array->data[i] = value;
+}
+
+/* Lowers the parsed and linked model, checks that ports exist and all inputs are driven. */
+Parsed graph_build(Graph *graph, Parser *parser) {
+    u32 block_count = (u32)parser->blocks.size();
+    graph->block_count = block_count;
+    graph->signal_count = (u32)parser->signals.length;
+    if (build_block_columns(graph, parser)) return ERROR;
+
+    // Port ranges
+    array_reserve(&graph->input_offsets, block_count + 1);
+    array_reserve(&graph->output_offsets, block_count + 1);
+    u32 inputs = 0;
+    u32 outputs = 0;
+    for (u32 b = 0; b < block_count; b++) {
+        array_add(&graph->input_offsets, inputs);
+        array_add(&graph->output_offsets, outputs);
+        inputs += block_input_count(&parser->blocks[b]);
+        outputs += block_output_count(&parser->blocks[b]);
+    }
+    array_add(&graph->input_offsets, inputs);
+    array_add(&graph->output_offsets, outputs);
+
+    array_reserve(&graph->input_block, inputs);
+    array_reserve(&graph->output_block, outputs);
+    for (u32 b = 0; b < block_count; b++) {
+        for (u32 i = graph->input_offsets[b]; i < graph->input_offsets[b + 1]; i++) array_add(&graph->input_block, b);
+        for (u32 o = graph->output_offsets[b]; o < graph->output_offsets[b + 1]; o++) array_add(&graph->output_block, b);
+    }
+
+    // Outputs behind signals
+    fill(&graph->output_signal, outputs, GRAPH_NONE);
+    array_reserve(&graph->signal_output, graph->signal_count);
+    for (u32 s = 0; s < graph->signal_count; s++) {
+        Port_Ref src = parser->signals[s];
+        if (src.port > graph_output_count(graph, src.block)) {
+            report_error("block % has no output %", block_name(parser, src.block), src.port);
+            return ERROR;
+        }
+        u32 slot = graph->output_offsets[src.block] + src.port - 1;
+        graph->output_signal[slot] = s;
+        array_add(&graph->signal_output, slot);
+    }
+
+    // Inputs and the fan-out of every signal, as a counting sort by signal
+    fill(&graph->input_signal, inputs, GRAPH_NONE);
+    fill(&graph->fanout_offsets, graph->signal_count + 1, 0);
+    Hash_Map<u64, u32> *drivers = &parser->signal_by_input;
+    for (u64 i = 0; i < drivers->capacity; i++) {
+        if (!drivers->used[i]) continue;
+        u32 block = (u32)(drivers->keys[i] >> 16);
+        u32 port = (u32)(drivers->keys[i] & 0xFFFF);
+        if (port > graph_input_count(graph, block)) {
+            report_error("block % has no input %", block_name(parser, block), port);
+            return ERROR;
+        }
+        u32 signal = drivers->values[i];
+        graph->input_signal[graph->input_offsets[block] + port - 1] = signal;
+        graph->fanout_offsets[signal + 1]++;
+    }
+
+    for (u32 s = 0; s < graph->signal_count; s++) {
+        graph->fanout_offsets[s + 1] += graph->fanout_offsets[s];
+    }
+
+    fill(&graph->fanout_inputs, graph->fanout_offsets[graph->signal_count], 0);
+    Array<u32> cursor = {};
+    array_add_range(&cursor, graph->fanout_offsets.data, graph->signal_count);
+    for (u32 i = 0; i < inputs; i++) {
+        u32 signal = graph->input_signal[i];
+        if (signal == GRAPH_NONE) {
+            u32 block = graph->input_block[i];
+            report_error("input % of block % is not connected",
+                         i - graph->input_offsets[block] + 1, block_name(parser, block));
+            array_free(&cursor);
+            return ERROR;
+        }
+        graph->fanout_inputs[cursor[signal]++] = i;
+    }
+    array_free(&cursor);
+
+    return GOOD;
+}
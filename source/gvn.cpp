@@ -0,0 +1,142 @@
+#pragma once
+
+/*
+ * gvn.cpp - value numbering of the step program, an op computing the same
+ * thing as an earlier one is dropped and its users read the earlier result.
+ *
+ * The step is a single straight block in SSA form, so numbering the ops in
+ * execution order finds every redundancy: when an op is reached its operands
+ * are already replaced by their first computation, so equal ops have equal
+ * terms. Ops are looked up by a hash of their canonical form.
+ *
+ * Canonical form: the constant and the terms, with the operands that can be
+ * swapped put in order. Addition is commutative, so the first two terms of
+ * an op without a constant can be swapped: a + b == b + a exactly, but
+ * (a + b) + c is not (a + c) + b. With `reassociate` any order is the same.
+ * Ops in different precisions are different even with the same terms.
+ */
+
+#include <string.h>
+#include <algorithm>
+
+#include "types.h"
+#include "array.hpp"
+#include "hash_map.hpp"
+#include "program.cpp"
+#include "optimize.cpp"
+
+namespace gvn_detail {
+
+#define GVN_NONE ((u32)-1)
+
+static bool term_less(Term a, Term b) {
+    if (a.value != b.value) return a.value < b.value;
+    u64 x, y;
+    memcpy(&x, &a.scale, sizeof(x));
+    memcpy(&y, &b.scale, sizeof(y));
+    return x < y;
+}
+
+/* Compares bits, so -0 and 0 differ and NaN scales match themselves. */
+static bool same_bits(f64 a, f64 b) {
+    return memcmp(&a, &b, sizeof(a)) == 0;
+}
+
+static void canonical(Program *program, Op *op, bool reassociate, Array<Term> *out) {
+    out->length = 0;
+    array_add_range(out, op_terms(program, op), op->term_count);
+    if (reassociate) {
+        std::sort(out->data, out->data + out->length, term_less);
+    } else if (!op->has_constant && out->length >= 2 && term_less((*out)[1], (*out)[0])) {
+        std::swap((*out)[0], (*out)[1]);
+    }
+}
+
+static u64 hash_op(Program *program, Op *op, Array<Term> *terms) {
+    u64 h = hash_map_hash(((u64)op->term_count * 2 + op->has_constant) * 4 + program->value_precision[op->result]);
+    auto mix = [&](u64 x) { h = hash_map_hash(h ^ (x + 0x9E3779B97F4A7C15ull + (h << 6) + (h >> 2))); };
+    if (op->has_constant) {
+        u64 bits;
+        memcpy(&bits, &op->constant, sizeof(bits));
+        mix(bits);
+    }
+    for (Term term : *terms) {
+        u64 bits;
+        memcpy(&bits, &term.scale, sizeof(bits));
+        mix(term.value);
+        mix(bits);
+    }
+    return h;
+}
+
+static bool same_op(Program *program, Op *a, Array<Term> *a_terms, Op *b, Array<Term> *b_terms) {
+    if (a->term_count != b->term_count || a->has_constant != b->has_constant) return false;
+    if (program->value_precision[a->result] != program->value_precision[b->result]) return false;
+    if (a->has_constant && !same_bits(a->constant, b->constant)) return false;
+    for (u32 t = 0; t < a->term_count; t++) {
+        Term x = (*a_terms)[t];
+        Term y = (*b_terms)[t];
+        if (x.value != y.value || !same_bits(x.scale, y.scale)) return false;
+    }
+    return true;
+}
+
+} // namespace gvn_detail
+
+/* Returns the number of ops removed. */
+u32 value_number(Program *program, Optimize_Options options) {
+    using namespace gvn_detail;
+
+    u32 value_count = program_value_count(program);
+    Array<Value> replacement = {};  // by value, itself unless it's a duplicate
+    array_reserve(&replacement, value_count);
+    for (Value v = 0; v < value_count; v++) array_add(&replacement, v);
+
+    Hash_Map<u64, u32> first_by_hash = {};  // hash -> the latest kept op with it
+    Array<u32> same_hash = {};              // by op, the previous kept op with the same hash
+    hash_map_reserve(&first_by_hash, program->ops.length);
+    array_reserve(&same_hash, program->ops.length);
+
+    Array<Term> terms = {};
+    Array<Term> other_terms = {};
+    u32 kept = 0;
+    for (u32 i = 0; i < program->ops.length; i++) {
+        Op op = program->ops[i];
+        Term *op_term = op_terms(program, &op);
+        for (u32 t = 0; t < op.term_count; t++) op_term[t].value = replacement[op_term[t].value];
+
+        canonical(program, &op, options.reassociate, &terms);
+        u64 hash = gvn_detail::hash_op(program, &op, &terms);
+        u32 *head = hash_map_get(&first_by_hash, hash);
+
+        u32 duplicate_of = GVN_NONE;
+        for (u32 j = head? *head : GVN_NONE; j != GVN_NONE; j = same_hash[j]) {
+            canonical(program, &program->ops[j], options.reassociate, &other_terms);
+            if (same_op(program, &op, &terms, &program->ops[j], &other_terms)) {
+                duplicate_of = j;
+                break;
+            }
+        }
+
+        if (duplicate_of != GVN_NONE) {
+            replacement[op.result] = program->ops[duplicate_of].result;
+            continue;
+        }
+        // Kept ops are compacted in place, `same_hash` is by the new index
+        array_add(&same_hash, head? *head : GVN_NONE);
+        hash_map_put(&first_by_hash, hash, kept);
+        program->ops[kept++] = op;
+    }
+    u32 removed = (u32)program->ops.length - kept;
+    program->ops.length = kept;
+
+    for (Update &update : program->updates) update.source = replacement[update.source];
+    for (Ext_Port &port : program->ports) port.value = replacement[port.value];
+
+    array_free(&replacement);
+    array_free(&same_hash);
+    array_free(&terms);
+    array_free(&other_terms);
+    hash_map_free(&first_by_hash);
+    return removed;
+}
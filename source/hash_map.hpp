@@ -0,0 +1,162 @@
+
+#ifndef C_LIKE_HASH_MAP_H
+#define C_LIKE_HASH_MAP_H
+
+#include <stddef.h> // for size_t
+#include <stdlib.h> // for calloc, free
+#include <assert.h> // for assert
+#include <type_traits>
+
+#include "types.h"
+
+/* Flat open addressing with linear probing, capacity is a power of two.
+ * Keys, values and the "slot is used" flags live in three plain arrays.
+ * Deletion shifts the following entries back, so there are no tombstones.
+ *
+ * Keys need `==` and a `hash_map_hash` overload, integers have one.
+ * Pointers to values are invalidated by any insertion.
+ */
+
+template <typename K, typename V>
+struct Hash_Map {
+    K *keys = nullptr;
+    V *values = nullptr;
+    u8 *used = nullptr;
+    size_t length = 0;
+    size_t capacity = 0;
+};
+
+template <typename K>
+inline typename std::enable_if<std::is_integral<K>::value, u64>::type hash_map_hash(K key) {
+    // murmur3 finalizer, consecutive SIDs must not land in consecutive slots
+    u64 h = (u64)key;
+    h ^= h >> 33;
+    h *= 0xFF51AFD7ED558CCDull;
+    h ^= h >> 33;
+    h *= 0xC4CEB9FE1A85EC53ull;
+    h ^= h >> 33;
+    return h;
+}
+
+template <typename K, typename V>
+void hash_map_free(Hash_Map<K, V> *map) {
+    free(map->keys);
+    free(map->values);
+    free(map->used);
+    // Reset to a clean state to prevent use-after-free errors.
+    map->keys = nullptr;
+    map->values = nullptr;
+    map->used = nullptr;
+    map->length = 0;
+    map->capacity = 0;
+}
+
+template <typename K, typename V>
+static size_t hash_map_slot(const Hash_Map<K, V> *map, K key, bool *found) {
+    size_t mask = map->capacity - 1;
+    size_t slot = hash_map_hash(key) & mask;
+    while (map->used[slot]) {
+        if (map->keys[slot] == key) {
+            *found = true;
+            return slot;
+        }
+        slot = (slot + 1) & mask;
+    }
+    *found = false;
+    return slot;
+}
+
+template <typename K, typename V>
+static void hash_map_rehash(Hash_Map<K, V> *map, size_t new_capacity) {
+    Hash_Map<K, V> old = *map;
+
+    map->capacity = new_capacity;
+    map->length = 0;
+    map->keys = (K *)malloc(new_capacity * sizeof(K));
+    map->values = (V *)malloc(new_capacity * sizeof(V));
+    map->used = (u8 *)calloc(new_capacity, sizeof(u8));
+    assert(map->keys != nullptr && map->values != nullptr && map->used != nullptr && "Buy more RAM lol!");
+
+    for (size_t i = 0; i < old.capacity; i++) {
+        if (!old.used[i]) continue;
+        bool found;
+        size_t slot = hash_map_slot(map, old.keys[i], &found);
+        map->keys[slot] = old.keys[i];
+        map->values[slot] = old.values[i];
+        map->used[slot] = 1;
+        map->length++;
+    }
+
+    hash_map_free(&old);
+}
+
+/* Makes room for `min_length` entries without rehashing, the load factor stays under 3/4. */
+template <typename K, typename V>
+void hash_map_reserve(Hash_Map<K, V> *map, size_t min_length) {
+    size_t new_capacity = map->capacity == 0 ? 16 : map->capacity;
+    while (new_capacity * 3 < min_length * 4) {
+        new_capacity *= 2;
+    }
+    if (new_capacity != map->capacity) {
+        hash_map_rehash(map, new_capacity);
+    }
+}
+
+template <typename K, typename V>
+V *hash_map_get(const Hash_Map<K, V> *map, K key) {
+    if (map->length == 0) return nullptr;
+    bool found;
+    size_t slot = hash_map_slot(map, key, &found);
+    return found ? &map->values[slot] : nullptr;
+}
+
+/* Returns the value for `key`, inserting `value` first if the key is new. */
+template <typename K, typename V>
+V *hash_map_get_or_add(Hash_Map<K, V> *map, K key, V value, bool *added = nullptr) {
+    hash_map_reserve(map, map->length + 1);
+    bool found;
+    size_t slot = hash_map_slot(map, key, &found);
+    if (!found) {
+        map->keys[slot] = key;
+        map->values[slot] = value;
+        map->used[slot] = 1;
+        map->length++;
+    }
+    if (added) *added = !found;
+    return &map->values[slot];
+}
+
+/* Inserts or overwrites. */
+template <typename K, typename V>
+void hash_map_put(Hash_Map<K, V> *map, K key, V value) {
+    bool added;
+    V *slot = hash_map_get_or_add(map, key, value, &added);
+    if (!added) *slot = value;
+}
+
+template <typename K, typename V>
+bool hash_map_remove(Hash_Map<K, V> *map, K key) {
+    if (map->length == 0) return false;
+    bool found;
+    size_t hole = hash_map_slot(map, key, &found);
+    if (!found) return false;
+
+    // Backward shift: move every following entry that may sit in the hole
+    size_t mask = map->capacity - 1;
+    size_t next = (hole + 1) & mask;
+    while (map->used[next]) {
+        size_t home = hash_map_hash(map->keys[next]) & mask;
+        bool can_move = ((next - home) & mask) >= ((next - hole) & mask);
+        if (can_move) {
+            map->keys[hole] = map->keys[next];
+            map->values[hole] = map->values[next];
+            hole = next;
+        }
+        next = (next + 1) & mask;
+    }
+    map->used[hole] = 0;
+    map->length--;
+    return true;
+}
+
+#endif // C_LIKE_HASH_MAP_H
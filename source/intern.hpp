@@ -0,0 +1,162 @@
+/*
+ * intern.hpp - string interning.
+ *
+ * Every distinct string gets a dense 32-bit Symbol, so names are compared
+ * and hashed as integers. Hashes are computed once on intern and kept
+ * next to the strings. Symbol 0 is reserved for "no name" (the empty string).
+ *
+ * With `copy_strings` the table keeps its own copies in an arena,
+ * otherwise it refers to the interned slices, which must outlive it
+ * (fine for a mapped model, not for a streamed one).
+ */
+
+#ifndef INTERN_HPP
+#define INTERN_HPP
+
+#include <string.h>
+
+#include "types.h"
+#include "array.hpp"
+#include "arena.hpp"
+#include "str.hpp"
+
+typedef u32 Symbol;
+
+#define SYMBOL_NONE ((Symbol)0)
+
+struct Intern_Table {
+    bool copy_strings = false;
+    Arena arena;
+    Array<str> strings;        // by Symbol
+    Array<u32> hashes;         // by Symbol
+    Array<Symbol> slots;       // open addressing, SYMBOL_NONE is empty, power of two
+    Array<Symbol> c_names;     // by Symbol, cache for intern_c_identifier
+};
+
+/* 8 bytes at a time, good enough for identifiers and cheap for short ones. */
+inline u32 str_hash(str self) {
+    u64 h = 0x9E3779B97F4A7C15ull ^ self.length;
+    const char *p = self.data;
+    u64 left = self.length;
+    while (left >= 8) {
+        u64 chunk;
+        memcpy(&chunk, p, 8);
+        h = (h ^ chunk) * 0xFF51AFD7ED558CCDull;
+        h ^= h >> 32;
+        p += 8;
+        left -= 8;
+    }
+    if (left) {
+        u64 chunk = 0;
+        memcpy(&chunk, p, left);
+        h = (h ^ chunk) * 0xC4CEB9FE1A85EC53ull;
+    }
+    h ^= h >> 29;
+    return (u32)h;
+}
+
+void intern_init(Intern_Table *table, bool copy_strings) {
+    table->copy_strings = copy_strings;
+    array_add(&table->strings, str_NULL);
+    array_add(&table->hashes, str_hash(str_NULL));
+    array_add(&table->c_names, SYMBOL_NONE);
+    array_reserve(&table->slots, 1024);
+    table->slots.length = table->slots.capacity;
+    memset(table->slots.data, 0, table->slots.length * sizeof(Symbol));
+}
+
+void intern_free(Intern_Table *table) {
+    arena_free(&table->arena);
+    array_free(&table->strings);
+    array_free(&table->hashes);
+    array_free(&table->slots);
+    array_free(&table->c_names);
+}
+
+static void intern_grow(Intern_Table *table) {
+    Array<Symbol> slots = {};
+    array_reserve(&slots, table->slots.length * 2);
+    slots.length = slots.capacity;
+    memset(slots.data, 0, slots.length * sizeof(Symbol));
+
+    u64 mask = slots.length - 1;
+    for (Symbol symbol = 1; symbol < table->strings.length; symbol++) {
+        u64 slot = table->hashes.data[symbol] & mask;
+        while (slots.data[slot] != SYMBOL_NONE) slot = (slot + 1) & mask;
+        slots.data[slot] = symbol;
+    }
+
+    array_free(&table->slots);
+    table->slots = slots;
+}
+
+Symbol intern(Intern_Table *table, str string) {
+    if (string.length == 0) return SYMBOL_NONE;
+
+    u32 hash = str_hash(string);
+    u64 mask = table->slots.length - 1;
+    u64 slot = hash & mask;
+    while (1) {
+        Symbol symbol = table->slots.data[slot];
+        if (symbol == SYMBOL_NONE) break;
+        if (table->hashes.data[symbol] == hash && table->strings.data[symbol] == string) {
+            return symbol;
+        }
+        slot = (slot + 1) & mask;
+    }
+
+    Symbol symbol = (Symbol)table->strings.length;
+    if (table->copy_strings) string = str_copy_arena(&table->arena, string);
+    array_add(&table->strings, string);
+    array_add(&table->hashes, hash);
+    array_add(&table->c_names, SYMBOL_NONE);
+    table->slots.data[slot] = symbol;
+
+    // Keep the load factor under 1/2
+    if (table->strings.length * 2 > table->slots.length) intern_grow(table);
+    return symbol;
+}
+
+inline str symbol_str(Intern_Table *table, Symbol symbol) {
+    return table->strings[symbol];
+}
+
+inline u32 symbol_hash(Intern_Table *table, Symbol symbol) {
+    return table->hashes[symbol];
+}
+
+/* The name as a C identifier: only [A-Za-z0-9_] are kept ("Unit Delay1" -> "UnitDelay1")
+ * and a leading digit gets an '_'. Computed once per symbol.
+ * Different names can map to the same identifier, codegen has to deal with that. */
+Symbol intern_c_identifier(Intern_Table *table, Symbol symbol) {
+    Symbol cached = table->c_names[symbol];
+    if (cached != SYMBOL_NONE) return cached;
+
+    // Built right in the table's arena, given back if the identifier is there already
+    str name = symbol_str(table, symbol);
+    Arena_Mark mark = arena_mark(&table->arena);
+    char *buffer = arena_new<char>(&table->arena, name.length + 2);
+    u64 length = 0;
+    for (u64 i = 0; i < name.length; i++) {
+        char c = name.data[i];
+        bool keep = (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') || c == '_';
+        if (!keep) continue;
+        if (length == 0 && c >= '0' && c <= '9') buffer[length++] = '_';
+        buffer[length++] = c;
+    }
+    if (length == 0) buffer[length++] = '_';
+    buffer[length] = '\0';
+
+    bool copy_strings = table->copy_strings;
+    table->copy_strings = false;
+    u64 symbol_count = table->strings.length;
+    Symbol identifier = intern(table, (str){buffer, length});
+    table->copy_strings = copy_strings;
+    if (table->strings.length == symbol_count) arena_reset(&table->arena, mark);
+
+    table->c_names[symbol] = identifier;
+    table->c_names[identifier] = identifier;
+    return identifier;
+}
+
+#endif // INTERN_HPP
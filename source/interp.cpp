@@ -0,0 +1,349 @@
+#pragma once
+
+/*
+ * interp.cpp - the step program run in process, without a C compiler.
+ *
+ * The program is lowered to bytecode for a register machine over doubles.
+ * What the generated C keeps in its struct gets a register of its own, the
+ * temporaries share registers like they share slots there (see storage.cpp),
+ * and every constant is a register that's set once. An op becomes a few
+ * instructions adding up its items in its evaluation order, halves of long
+ * sums first when the C has them as balanced trees, so the results are bit
+ * for bit the ones of the generated C:
+ *
+ *     ADD_GAIN r4, r1, r2, -0.5     r4 = r1 + r2 * -0.5
+ *     SUB      r4, r4, r3           r4 = r4 - r3
+ *
+ * A single precision op rounds every operand, product and partial sum to
+ * float. That's exactly float arithmetic, a double has more than twice the
+ * bits so rounding twice doesn't change anything. At the end of the step
+ * DELAY_STORE copies the updates into the states, which are plain registers
+ * for the ops, a single precision state gets a double ROUNDed.
+ *
+ * Dispatch is threaded: every handler jumps straight to the next one's code
+ * through a table of label addresses (computed goto), there's no loop and
+ * no switch in between. The ports are a table in the runtime's
+ * nwocg_ExtPort layout pointing at the registers, so a host drives the
+ * interpreter just like the generated code.
+ */
+
+#include <math.h>
+#include <string.h>
+
+#include "types.h"
+#include "array.hpp"
+#include "arena.hpp"
+#include "print.hpp"
+#include "hash_map.hpp"
+#include "program.cpp"
+#include "storage.cpp"
+
+enum Opcode : u8 {
+    OP_HALT,
+    OP_COPY,         // dst = a
+    OP_NEG,          // dst = -a
+    OP_GAIN,         // dst = a * k
+    OP_ADD,          // dst = a + b
+    OP_SUB,          // dst = a - b
+    OP_ADD_GAIN,     // dst = a + b * k
+    OP_ROUND,        // dst = (float)a
+    OP_DELAY_STORE,  // dst = a, the state for the next step
+    OP_COUNT,
+};
+
+static const char *const opcode_names[OP_COUNT] = {
+    "HALT", "COPY", "NEG", "GAIN", "ADD", "SUB", "ADD_GAIN", "ROUND", "DELAY_STORE",
+};
+
+struct Instruction {
+    u8 opcode;  // Opcode
+    u32 dst;
+    u32 a;
+    u32 b;
+    f64 k;
+};
+
+/* The runtime's nwocg_ExtPort. */
+struct Interp_Port {
+    const char *name;
+    f64 *value;
+    int is_input;
+};
+
+struct Interp {
+    Array<Instruction> code;    // the step, ends with OP_HALT
+    Array<Instruction> init;    // the states' initial values, as constants copied in
+    Array<f64> registers;
+    u32 static_count;           // the registers below are the struct's members, they outlive a step
+    Array<Interp_Port> ports;   // sorted by name, ends with a null name
+    Arena arena;                // port names
+};
+
+void interp_free(Interp *interp) {
+    array_free(&interp->code);
+    array_free(&interp->init);
+    array_free(&interp->registers);
+    array_free(&interp->ports);
+    arena_free(&interp->arena);
+}
+
+namespace interp_detail {
+
+// Scratch registers after the values: the sum of an op that would overwrite
+// one of its own operands, a rounded product and a rounded operand
+#define INTERP_SCRATCH 3
+
+struct Lowering {
+    Interp *interp;
+    Program *program;
+    Storage storage;
+    Array<u32> reg;                  // by value
+    u32 scratch;                     // the first scratch register
+    Array<u32> halves;               // by depth, the right halves of balanced sums
+    Hash_Map<u64, u32> constants;    // bits -> register
+    bool reassociate;                // long sums as balanced trees, like codegen does
+};
+
+static u32 constant_register(Lowering *lowering, f64 value) {
+    u64 bits;
+    memcpy(&bits, &value, sizeof(bits));
+    bool added = false;
+    u32 *reg = hash_map_get_or_add(&lowering->constants, bits, (u32)lowering->interp->registers.length, &added);
+    if (added) array_add(&lowering->interp->registers, value);
+    return *reg;
+}
+
+static void emit(Lowering *lowering, Opcode opcode, u32 dst, u32 a, u32 b = 0, f64 k = 0) {
+    array_add(&lowering->interp->code, (Instruction){(u8)opcode, dst, a, b, k});
+}
+
+/* An item of an op's sum, register * scale. */
+struct Item {
+    u32 reg;
+    f64 scale;
+};
+
+/* dst = a + item */
+static void emit_add(Lowering *lowering, u32 dst, u32 a, Item item) {
+    if (item.scale == 1.0) emit(lowering, OP_ADD, dst, a, item.reg);
+    else if (item.scale == -1.0) emit(lowering, OP_SUB, dst, a, item.reg);
+    else emit(lowering, OP_ADD_GAIN, dst, a, item.reg, item.scale);
+}
+
+/* dst = item */
+static void emit_item(Lowering *lowering, u32 dst, Item item) {
+    if (item.scale == 1.0 && item.reg == dst) return;
+    if (item.scale == 1.0) emit(lowering, OP_COPY, dst, item.reg);
+    else if (item.scale == -1.0) emit(lowering, OP_NEG, dst, item.reg);
+    else emit(lowering, OP_GAIN, dst, item.reg, 0, item.scale);
+}
+
+/* A single precision item rounded to ±reg, into `target` if it needs to be computed. */
+static Item round_item(Lowering *lowering, Item item, Value value, u32 target) {
+    if (value != VALUE_NONE && lowering->program->value_precision[value] != PRECISION_SINGLE) {
+        emit(lowering, OP_ROUND, target, item.reg);
+        item.reg = target;
+    }
+    if (fabs(item.scale) != 1.0) {
+        emit(lowering, OP_GAIN, target, item.reg, 0, item.scale);
+        emit(lowering, OP_ROUND, target, target);
+        item = {target, 1.0};
+    }
+    return item;
+}
+
+/* The items of one op, with the values they read or VALUE_NONE for the constant. */
+struct Sum {
+    Array<Item> items;
+    Array<Value> values;
+    bool single;
+};
+
+/* Items [first, end) added up into `target`, in the order codegen's emit_sum has. */
+static void lower_sum(Lowering *lowering, Sum *sum, u32 first, u32 end, u32 target, u32 depth) {
+    Item *items = sum->items.data;
+    if (lowering->reassociate && end - first > 3) {
+        u32 middle = first + (end - first) / 2;
+        if (depth == lowering->halves.length) {
+            array_add(&lowering->halves, (u32)lowering->interp->registers.length);
+            array_add(&lowering->interp->registers, 0.0);
+        }
+        u32 half = lowering->halves[depth];
+        lower_sum(lowering, sum, first, middle, target, depth + 1);
+        lower_sum(lowering, sum, middle, end, half, depth + 1);
+        emit(lowering, OP_ADD, target, target, half);
+        if (sum->single) emit(lowering, OP_ROUND, target, target);
+        return;
+    }
+
+    if (sum->single) {
+        u32 product = lowering->scratch + 1;
+        u32 operand = lowering->scratch + 2;
+        emit_item(lowering, target, round_item(lowering, items[first], sum->values[first], target));
+        for (u32 i = first + 1; i < end; i++) {
+            Item item = round_item(lowering, items[i], sum->values[i], items[i].scale == 1.0 || items[i].scale == -1.0? operand : product);
+            emit_add(lowering, target, target, item);
+            emit(lowering, OP_ROUND, target, target);
+        }
+    } else {
+        // The first two items in one instruction when the first one is only a register
+        u32 next = first + 1;
+        if (end - first >= 2 && items[first].scale == 1.0) {
+            emit_add(lowering, target, items[first].reg, items[first + 1]);
+            next = first + 2;
+        } else {
+            emit_item(lowering, target, items[first]);
+        }
+        for (u32 i = next; i < end; i++) emit_add(lowering, target, target, items[i]);
+    }
+}
+
+static void lower_op(Lowering *lowering, Op *op, Sum *sum) {
+    Program *program = lowering->program;
+    Term *terms = op_terms(program, op);
+    sum->items.length = 0;
+    sum->values.length = 0;
+    sum->single = program->value_precision[op->result] == PRECISION_SINGLE;
+    if (op->has_constant || op->term_count == 0) {
+        array_add(&sum->items, (Item){constant_register(lowering, op->has_constant? op->constant : 0), 1.0});
+        array_add(&sum->values, VALUE_NONE);
+    }
+    for (u32 t = 0; t < op->term_count; t++) {
+        array_add(&sum->items, (Item){lowering->reg[terms[t].value], terms[t].scale});
+        array_add(&sum->values, terms[t].value);
+    }
+
+    // Adding up in the result's register is fine unless an item after the first reads it
+    u32 dst = lowering->reg[op->result];
+    u32 target = dst;
+    for (u32 i = 1; i < sum->items.length; i++) {
+        if (sum->items[i].reg == dst) target = lowering->scratch;
+    }
+    lower_sum(lowering, sum, 0, (u32)sum->items.length, target, 0);
+    if (target != dst) emit(lowering, OP_COPY, dst, target);
+}
+
+} // namespace interp_detail
+
+/* Lowers the program to bytecode, the registers are zero and the states not initialized yet. */
+void interp_build(Interp *interp, Program *program, Intern_Table *symbols, bool reassociate) {
+    using namespace interp_detail;
+
+    Lowering lowering = {};
+    lowering.interp = interp;
+    lowering.program = program;
+    lowering.reassociate = reassociate;
+    storage_allocate(&lowering.storage, program, /*max_depth*/1);
+
+    u32 value_count = program_value_count(program);
+    u32 registers = 0;
+    array_reserve(&lowering.reg, value_count);
+    for (Value v = 0; v < value_count; v++) {
+        u8 storage_class = lowering.storage.storage_class[v];
+        array_add(&lowering.reg, storage_class == STORAGE_STATIC? registers++ : (u32)-1);
+    }
+    interp->static_count = registers;
+    for (Value v = 0; v < value_count; v++) {
+        if (lowering.storage.storage_class[v] == STORAGE_LOCAL) lowering.reg[v] = registers + lowering.storage.slot[v];
+    }
+    registers += lowering.storage.slot_count;
+    lowering.scratch = registers;
+    registers += INTERP_SCRATCH;
+    array_reserve(&interp->registers, registers);
+    for (u32 r = 0; r < registers; r++) array_add(&interp->registers, 0.0);
+
+    Sum sum = {};
+    for (Op &op : program->ops) lower_op(&lowering, &op, &sum);
+    for (Update &update : program->updates) {
+        // A single precision state takes a double rounded
+        bool narrowing = program->value_precision[update.state] == PRECISION_SINGLE &&
+                         program->value_precision[update.source] != PRECISION_SINGLE;
+        emit(&lowering, narrowing? OP_ROUND : OP_DELAY_STORE, lowering.reg[update.state], lowering.reg[update.source]);
+        u32 initial = constant_register(&lowering, program->value_initial[update.state]);
+        array_add(&interp->init, (Instruction){OP_COPY, lowering.reg[update.state], initial, 0, 0});
+    }
+    emit(&lowering, OP_HALT, 0, 0);
+    array_add(&interp->init, (Instruction){OP_HALT, 0, 0, 0, 0});
+
+    // The registers are all there now, the ports can point at them
+    for (Ext_Port &port : program->ports) {
+        str name = str_copy_arena(&interp->arena, symbol_str(symbols, port.name));
+        array_add(&interp->ports, (Interp_Port){name.data, &interp->registers[lowering.reg[port.value]], (int)port.is_input});
+    }
+    array_add(&interp->ports, (Interp_Port){NULL, NULL, 0});
+
+    array_free(&sum.items);
+    array_free(&sum.values);
+    array_free(&lowering.reg);
+    array_free(&lowering.halves);
+    hash_map_free(&lowering.constants);
+    storage_free(&lowering.storage);
+}
+
+namespace interp_detail {
+
+static void run(Instruction *code, f64 *r) {
+    static void *const handlers[] = {
+        &&op_halt, &&op_copy, &&op_neg, &&op_gain, &&op_add, &&op_sub, &&op_add_gain, &&op_round, &&op_delay_store,
+    };
+    static_assert(sizeof(handlers) / sizeof(handlers[0]) == OP_COUNT, "a handler for every opcode");
+
+    Instruction *ip = code;
+#define INTERP_NEXT() goto *handlers[(++ip)->opcode]
+    goto *handlers[ip->opcode];
+op_copy:        r[ip->dst] = r[ip->a];                     INTERP_NEXT();
+op_neg:         r[ip->dst] = -r[ip->a];                    INTERP_NEXT();
+op_gain:        r[ip->dst] = r[ip->a] * ip->k;             INTERP_NEXT();
+op_add:         r[ip->dst] = r[ip->a] + r[ip->b];          INTERP_NEXT();
+op_sub:         r[ip->dst] = r[ip->a] - r[ip->b];          INTERP_NEXT();
+op_add_gain:    r[ip->dst] = r[ip->a] + r[ip->b] * ip->k;  INTERP_NEXT();
+op_round:       r[ip->dst] = (f32)r[ip->a];                INTERP_NEXT();
+op_delay_store: r[ip->dst] = r[ip->a];                     INTERP_NEXT();
+op_halt:        return;
+#undef INTERP_NEXT
+}
+
+} // namespace interp_detail
+
+/* nwocg_generated_init */
+void interp_init(Interp *interp) {
+    interp_detail::run(interp->init.data, interp->registers.data);
+}
+
+/* nwocg_generated_step */
+void interp_step(Interp *interp) {
+    interp_detail::run(interp->code.data, interp->registers.data);
+}
+
+/* The bytecode as text, one instruction per line. */
+void interp_print(Interp *interp, Array<char> *out) {
+    builder_print(out, "% registers, % instructions\n", interp->registers.length, interp->code.length);
+    for (Instruction &instruction : interp->code) {
+        builder_print(out, "    %", str_cstr_view((char *)opcode_names[instruction.opcode]));
+        switch (instruction.opcode) {
+        case OP_HALT:
+            break;
+        case OP_COPY:
+        case OP_NEG:
+        case OP_ROUND:
+        case OP_DELAY_STORE:
+            builder_print(out, " r%, r%", instruction.dst, instruction.a);
+            break;
+        case OP_GAIN:
+            builder_print(out, " r%, r%, %", instruction.dst, instruction.a, instruction.k);
+            break;
+        case OP_ADD:
+        case OP_SUB:
+            builder_print(out, " r%, r%, r%", instruction.dst, instruction.a, instruction.b);
+            break;
+        case OP_ADD_GAIN:
+            builder_print(out, " r%, r%, r%, %", instruction.dst, instruction.a, instruction.b, instruction.k);
+            break;
+        }
+        builder_add(out, str("\n"));
+    }
+    for (Interp_Port *port = interp->ports.data; port->name != NULL; port++) {
+        builder_print(out, "% r% %\n", port->is_input? str("in ") : str("out"), (u64)(port->value - interp->registers.data),
+                      str_cstr_view((char *)port->name));
+    }
+}
@@ -0,0 +1,404 @@
+#pragma once
+
+/*
+ * jit.cpp - the interpreter's bytecode as x86-64 machine code.
+ *
+ * Every instruction becomes one or two SSE2 instructions on scalar doubles,
+ * the same operations in the same order as the bytecode, so the results stay
+ * bit for bit the ones of the generated C. ROUND is a conversion to float and
+ * back, NEG flips the sign bit.
+ *
+ * The step is one straight line of code, so the registers of the bytecode are
+ * given xmm registers by looking ahead: a value read again later stays in an
+ * xmm register, and when all 16 are taken the one read again the furthest
+ * ahead gives its place up (Belady). A value read for the last time leaves
+ * its xmm register to the result. Temporaries only go to memory when they're
+ * evicted while still needed, the struct's members (inputs, states, Outports)
+ * are stored when evicted and at the end of the step, so UnitDelay states
+ * live in memory between steps. Constants are read from memory.
+ *
+ * The code is System V: the registers array comes in rdi and is addressed as
+ * [rdi + 8 * r]. init and step go into one buffer mapped executable, followed
+ * by their constants, which are addressed relative to rip.
+ */
+
+#include <string.h>
+#include <sys/mman.h>
+
+#include "types.h"
+#include "array.hpp"
+#include "print.hpp"
+#include "hash_map.hpp"
+#include "interp.cpp"
+
+#if defined(__x86_64__) || defined(_M_X64)
+#define JIT_X86 1
+#endif
+
+typedef void (*Jit_Function)(f64 *registers);
+
+struct Jit {
+    u8 *memory;   // the code, then the constants
+    u64 size;
+    Jit_Function init;
+    Jit_Function step;
+    f64 *registers;  // the interpreter's, its ports point at them
+};
+
+void jit_free(Jit *jit) {
+    if (jit->memory != NULL) munmap(jit->memory, jit->size);
+    *jit = {};
+}
+
+namespace jit_detail {
+
+#define JIT_XMM_COUNT 16
+#define JIT_NONE ((u32)-1)
+#define JIT_SIGN_BIT ((u64)1 << 63)
+
+// Encodings of the SSE2 instructions, a mandatory prefix and the byte after 0F
+enum Sse : u16 {
+    SSE_MOVSD_LOAD  = 0xF210,
+    SSE_MOVSD_STORE = 0xF211,
+    SSE_ADDSD       = 0xF258,
+    SSE_MULSD       = 0xF259,
+    SSE_SUBSD       = 0xF25C,
+    SSE_CVTSD2SS    = 0xF25A,
+    SSE_CVTSS2SD    = 0xF35A,
+    SSE_MOVAPD      = 0x6628,
+    SSE_XORPD       = 0x6657,
+};
+
+/* A rip relative displacement to patch once the constants have their place. */
+struct Fixup {
+    u32 at;        // of the disp32 in the code
+    u32 constant;  // index in the pool
+};
+
+/* An operand in an xmm register or in the registers array. */
+struct Operand {
+    u32 xmm;  // JIT_NONE when in memory
+    u32 reg;
+};
+
+/* When an instruction's operands and result are read next, JIT_NONE for never. */
+struct Next_Use {
+    u32 a;
+    u32 b;
+    u32 dst;
+};
+
+struct Xmm {
+    u32 reg;       // of the bytecode, JIT_NONE when free
+    u32 next_use;  // instruction index
+    bool dirty;    // newer than the registers array
+};
+
+struct Compiler {
+    Interp *interp;
+    Array<u8> code;
+    Array<Fixup> fixups;
+    Array<u64> pool;                  // constants as bits, the sign mask first
+    Hash_Map<u64, u32> pool_index;    // bits -> index
+    Array<Next_Use> next;             // by instruction
+    Array<u32> next_read;             // by register, while looking ahead
+    Array<u32> cached;                // by register, its xmm register or JIT_NONE
+    Xmm xmm[JIT_XMM_COUNT];
+};
+
+static void emit_byte(Compiler *c, u8 byte) {
+    array_add(&c->code, byte);
+}
+
+static void emit_u32(Compiler *c, u32 value) {
+    for (u32 i = 0; i < 4; i++) emit_byte(c, (u8)(value >> (8 * i)));
+}
+
+/* Prefix, REX if an xmm8+ is involved, 0F and the opcode. */
+static void emit_sse_opcode(Compiler *c, Sse sse, u32 reg, u32 rm) {
+    emit_byte(c, (u8)(sse >> 8));
+    u8 rex = 0x40 | ((reg >> 3) << 2) | (rm >> 3);
+    if (rex != 0x40) emit_byte(c, rex);
+    emit_byte(c, 0x0F);
+    emit_byte(c, (u8)sse);
+}
+
+/* sse xmm, xmm */
+static void emit_sse_rr(Compiler *c, Sse sse, u32 xmm, u32 source) {
+    emit_sse_opcode(c, sse, xmm, source);
+    emit_byte(c, 0xC0 | ((xmm & 7) << 3) | (source & 7));
+}
+
+/* sse xmm, [rdi + 8 * reg] (or the other way around for a store) */
+static void emit_sse_memory(Compiler *c, Sse sse, u32 xmm, u32 reg) {
+    emit_sse_opcode(c, sse, xmm, 0);
+    emit_byte(c, 0x80 | ((xmm & 7) << 3) | 7);
+    emit_u32(c, reg * 8);
+}
+
+/* sse xmm, [rip + constant] */
+static void emit_sse_constant(Compiler *c, Sse sse, u32 xmm, u64 bits) {
+    bool added = false;
+    u32 *index = hash_map_get_or_add(&c->pool_index, bits, (u32)c->pool.length, &added);
+    if (added) array_add(&c->pool, bits);
+    emit_sse_opcode(c, sse, xmm, 0);
+    emit_byte(c, ((xmm & 7) << 3) | 5);
+    array_add(&c->fixups, (Fixup){(u32)c->code.length, *index});
+    emit_u32(c, 0);
+}
+
+static void emit_sse(Compiler *c, Sse sse, u32 xmm, Operand operand) {
+    if (operand.xmm != JIT_NONE) emit_sse_rr(c, sse, xmm, operand.xmm);
+    else emit_sse_memory(c, sse, xmm, operand.reg);
+}
+
+static bool is_static(Compiler *c, u32 reg) {
+    return reg < c->interp->static_count;
+}
+
+/* When every operand and result is read next, looking back from the end. */
+static void find_next_uses(Compiler *c, Instruction *code, u32 count) {
+    c->next.length = 0;
+    array_reserve(&c->next, count);
+    c->next.length = count;
+    for (u32 i = count; i-- > 0;) {
+        Instruction in = code[i];
+        Next_Use next = {JIT_NONE, JIT_NONE, JIT_NONE};
+        bool writes = in.opcode != OP_HALT;
+        bool reads_b = in.opcode == OP_ADD || in.opcode == OP_SUB || in.opcode == OP_ADD_GAIN;
+        // The instruction reads before it writes, the old value isn't read after it
+        if (writes) {
+            next.dst = c->next_read[in.dst];
+            c->next_read[in.dst] = JIT_NONE;
+        }
+        if (writes) next.a = c->next_read[in.a];
+        if (reads_b) next.b = c->next_read[in.b];
+        if (writes) c->next_read[in.a] = i;
+        if (reads_b) c->next_read[in.b] = i;
+        c->next[i] = next;
+    }
+    // Clean for the next function
+    for (u32 i = 0; i < count; i++) {
+        c->next_read[code[i].dst] = JIT_NONE;
+        c->next_read[code[i].a] = JIT_NONE;
+        c->next_read[code[i].b] = JIT_NONE;
+    }
+}
+
+static void unmap(Compiler *c, u32 xmm) {
+    c->cached[c->xmm[xmm].reg] = JIT_NONE;
+    c->xmm[xmm] = {JIT_NONE, JIT_NONE, false};
+}
+
+static void map(Compiler *c, u32 xmm, u32 reg, u32 next_use, bool dirty) {
+    c->cached[reg] = xmm;
+    c->xmm[xmm] = {reg, next_use, dirty};
+}
+
+/* Writes a dirty value back if it's still needed, before its xmm register is taken. */
+static void write_back(Compiler *c, u32 xmm) {
+    Xmm *state = &c->xmm[xmm];
+    if (state->dirty && (is_static(c, state->reg) || state->next_use != JIT_NONE)) {
+        emit_sse_memory(c, SSE_MOVSD_STORE, xmm, state->reg);
+    }
+}
+
+/* A free xmm register, or the one read again the furthest ahead. */
+static u32 allocate(Compiler *c, u32 pinned) {
+    u32 best = JIT_NONE;
+    for (u32 x = 0; x < JIT_XMM_COUNT; x++) {
+        if (pinned & (1u << x)) continue;
+        if (c->xmm[x].reg == JIT_NONE) return x;
+        // JIT_NONE is never read again, the furthest
+        if (best == JIT_NONE || c->xmm[x].next_use > c->xmm[best].next_use) best = x;
+    }
+    write_back(c, best);
+    unmap(c, best);
+    return best;
+}
+
+/* `reg` as an operand, loaded into an xmm register if it's read again after this. */
+static Operand read_operand(Compiler *c, u32 reg, u32 next_use, u32 pinned) {
+    u32 xmm = c->cached[reg];
+    if (xmm == JIT_NONE && next_use != JIT_NONE) {
+        xmm = allocate(c, pinned);
+        emit_sse_memory(c, SSE_MOVSD_LOAD, xmm, reg);
+        map(c, xmm, reg, next_use, false);
+    }
+    return (Operand){xmm, reg};
+}
+
+/* An xmm register with the value of `reg` that the result can overwrite. */
+static u32 result_from(Compiler *c, u32 reg, u32 next_use, u32 pinned) {
+    Operand operand = read_operand(c, reg, next_use, pinned);
+    if (operand.xmm != JIT_NONE && next_use == JIT_NONE && !(pinned & (1u << operand.xmm))) {
+        // Its last read, the result takes its place
+        write_back(c, operand.xmm);
+        unmap(c, operand.xmm);
+        return operand.xmm;
+    }
+    if (operand.xmm != JIT_NONE) pinned |= 1u << operand.xmm;
+    u32 xmm = allocate(c, pinned);
+    if (operand.xmm != JIT_NONE) emit_sse_rr(c, SSE_MOVAPD, xmm, operand.xmm);
+    else emit_sse_memory(c, SSE_MOVSD_LOAD, xmm, reg);
+    return xmm;
+}
+
+/* After the instruction read `reg`, its xmm register is free if nothing reads it anymore. */
+static void release(Compiler *c, u32 reg, u32 next_use) {
+    u32 xmm = c->cached[reg];
+    if (xmm == JIT_NONE) return;
+    c->xmm[xmm].next_use = next_use;
+    if (next_use == JIT_NONE && !(c->xmm[xmm].dirty && is_static(c, reg))) unmap(c, xmm);
+}
+
+/* The result in `xmm` is the new value of `reg`. */
+static void define(Compiler *c, u32 xmm, u32 reg, u32 next_use) {
+    if (c->cached[reg] != JIT_NONE) unmap(c, c->cached[reg]);  // the old value
+    if (next_use == JIT_NONE && !is_static(c, reg)) return;    // nothing reads it
+    map(c, xmm, reg, next_use, true);
+}
+
+static u32 pin(Operand operand) {
+    return operand.xmm != JIT_NONE? 1u << operand.xmm : 0;
+}
+
+static void compile_function(Compiler *c, Array<Instruction> *code) {
+    find_next_uses(c, code->data, (u32)code->length);
+    for (u32 i = 0; i < code->length; i++) {
+        Instruction in = (*code)[i];
+        Next_Use next = c->next[i];
+        u32 result = JIT_NONE;
+        switch (in.opcode) {
+        case OP_HALT:
+            for (u32 x = 0; x < JIT_XMM_COUNT; x++) {
+                if (c->xmm[x].reg == JIT_NONE) continue;
+                if (c->xmm[x].dirty && is_static(c, c->xmm[x].reg)) emit_sse_memory(c, SSE_MOVSD_STORE, x, c->xmm[x].reg);
+                unmap(c, x);
+            }
+            emit_byte(c, 0xC3);  // ret
+            continue;
+        case OP_COPY:
+        case OP_DELAY_STORE:
+            result = result_from(c, in.a, next.a, 0);
+            break;
+        case OP_NEG:
+            result = result_from(c, in.a, next.a, 0);
+            emit_sse_constant(c, SSE_XORPD, result, JIT_SIGN_BIT);
+            break;
+        case OP_GAIN: {
+            u64 bits;
+            memcpy(&bits, &in.k, sizeof(bits));
+            result = result_from(c, in.a, next.a, 0);
+            emit_sse_constant(c, SSE_MULSD, result, bits);
+        } break;
+        case OP_ROUND:
+            result = result_from(c, in.a, next.a, 0);
+            emit_sse_rr(c, SSE_CVTSD2SS, result, result);
+            emit_sse_rr(c, SSE_CVTSS2SD, result, result);
+            break;
+        case OP_ADD:
+        case OP_SUB: {
+            Operand b = read_operand(c, in.b, next.b, 0);
+            result = result_from(c, in.a, next.a, in.a == in.b? 0 : pin(b));
+            emit_sse(c, in.opcode == OP_ADD? SSE_ADDSD : SSE_SUBSD, result, b);
+        } break;
+        case OP_ADD_GAIN: {
+            // a + b * k, addition commutes exactly so it's (b * k) + a.
+            // a is read after the multiply, so it keeps its xmm register even if it is b
+            u64 bits;
+            memcpy(&bits, &in.k, sizeof(bits));
+            Operand a = read_operand(c, in.a, next.a, 0);
+            result = result_from(c, in.b, next.b, pin(a));
+            emit_sse_constant(c, SSE_MULSD, result, bits);
+            emit_sse(c, SSE_ADDSD, result, a);
+        } break;
+        }
+        release(c, in.a, next.a);
+        if (in.opcode == OP_ADD || in.opcode == OP_SUB || in.opcode == OP_ADD_GAIN) release(c, in.b, next.b);
+        define(c, result, in.dst, next.dst);
+    }
+}
+
+} // namespace jit_detail
+
+/* Compiles the interpreter's init and step, which then run on its registers. */
+Parsed jit_compile(Jit *jit, Interp *interp) {
+    using namespace jit_detail;
+#ifndef JIT_X86
+    report_error("the JIT needs an x86-64 build");
+    return ERROR;
+#endif
+    if (interp->registers.length > INT32_MAX / 8) {
+        report_error("% registers are too many for the JIT", interp->registers.length);
+        return ERROR;
+    }
+
+    Compiler c = {};
+    c.interp = interp;
+    array_reserve(&c.next_read, interp->registers.length);
+    array_reserve(&c.cached, interp->registers.length);
+    for (u32 r = 0; r < interp->registers.length; r++) {
+        array_add(&c.next_read, JIT_NONE);
+        array_add(&c.cached, JIT_NONE);
+    }
+    for (Xmm &xmm : c.xmm) xmm = {JIT_NONE, JIT_NONE, false};
+    // xorpd needs its 16 bytes aligned
+    array_add(&c.pool, JIT_SIGN_BIT);
+    array_add(&c.pool, (u64)0);
+    hash_map_get_or_add(&c.pool_index, JIT_SIGN_BIT, 0u);
+    hash_map_get_or_add(&c.pool_index, (u64)0, 1u);
+
+    compile_function(&c, &interp->init);
+    while (c.code.length % 16 != 0) emit_byte(&c, 0xCC);  // int3
+    u64 step_offset = c.code.length;
+    compile_function(&c, &interp->code);
+    while (c.code.length % 16 != 0) emit_byte(&c, 0xCC);
+    u64 pool_offset = c.code.length;
+    for (Fixup &fixup : c.fixups) {
+        u32 displacement = (u32)(pool_offset + 8 * fixup.constant - (fixup.at + 4));
+        memcpy(&c.code[fixup.at], &displacement, sizeof(displacement));
+    }
+
+    Parsed result = GOOD;
+    u64 size = pool_offset + 8 * c.pool.length;
+    void *memory = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (memory == MAP_FAILED) {
+        report_error("could not map % bytes for the JIT", size);
+        result = ERROR;
+    } else {
+        memcpy(memory, c.code.data, c.code.length);
+        memcpy((u8 *)memory + pool_offset, c.pool.data, 8 * c.pool.length);
+        if (mprotect(memory, size, PROT_READ | PROT_EXEC) != 0) {
+            report_error("could not make the JIT's code executable");
+            munmap(memory, size);
+            result = ERROR;
+        }
+    }
+    if (result == GOOD) {
+        jit->memory = (u8 *)memory;
+        jit->size = size;
+        jit->init = (Jit_Function)jit->memory;
+        jit->step = (Jit_Function)(jit->memory + step_offset);
+        jit->registers = interp->registers.data;
+    }
+
+    array_free(&c.code);
+    array_free(&c.fixups);
+    array_free(&c.pool);
+    hash_map_free(&c.pool_index);
+    array_free(&c.next);
+    array_free(&c.next_read);
+    array_free(&c.cached);
+    return result;
+}
+
+/* nwocg_generated_init */
+void jit_init(Jit *jit) {
+    jit->init(jit->registers);
+}
+
+/* nwocg_generated_step */
+void jit_step(Jit *jit) {
+    jit->step(jit->registers);
+}
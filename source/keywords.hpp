@@ -0,0 +1,122 @@
+/*
+ * keywords.hpp - compile-time perfect hashing of small fixed string sets.
+ *
+ * The table is built by a constexpr search for a seed that puts every keyword
+ * into its own slot, so a lookup is one hash of a few bytes, one length check
+ * and one memcmp, no matter how many keywords there are.
+ *
+ * Example:
+ *   constexpr Keyword<Color> color_keywords[] = {{"red", RED}, {"green", GREEN}};
+ *   constexpr auto color_table = make_keyword_table(color_keywords, NO_COLOR);
+ *   Color c = keyword_lookup(color_table, str("green"));
+ *
+ * If two keywords share the length and the hashed bytes,
+ * no seed can separate them and the build fails on the static_assert.
+ */
+
+#ifndef KEYWORDS_HPP
+#define KEYWORDS_HPP
+
+#include <stddef.h>
+#include <string.h>
+
+#include "types.h"
+#include "str.hpp"
+
+template <typename E>
+struct Keyword {
+    const char *name;
+    E value;
+};
+
+template <typename E, size_t Size>
+struct Keyword_Table {
+    const char *names[Size] = {};
+    u8 lengths[Size] = {};  // 0 for empty slots
+    E values[Size] = {};
+    E missing = {};
+    u32 seed = 0;
+    bool found_seed = false;
+};
+
+namespace keywords_detail {
+
+constexpr size_t constexpr_strlen(const char *s) {
+    size_t length = 0;
+    while (s[length]) length++;
+    return length;
+}
+
+/* Size with enough free slots for a seed search to succeed quickly. */
+constexpr size_t table_size(size_t count) {
+    size_t size = 8;
+    while (size < count * 4) size *= 2;
+    return size;
+}
+
+/* Mixes the length and up to 3 leading and 3 trailing bytes. */
+constexpr u32 hash(const char *data, size_t length, u32 seed) {
+    u32 h = seed ^ (u32)length * 0x9E3779B1u;
+    size_t head = length < 3? length : 3;
+    for (size_t i = 0; i < head; i++) {
+        h = (h ^ (u8)data[i]) * 0x01000193u;
+    }
+    for (size_t i = length > 3? length - 3 : length; i < length; i++) {
+        h = (h ^ (u8)data[i]) * 0x01000193u;
+    }
+    return h ^ (h >> 15);
+}
+
+} // namespace keywords_detail
+
+template <typename E, size_t Count>
+constexpr auto make_keyword_table(const Keyword<E> (&keywords)[Count], E missing) {
+    constexpr size_t size = keywords_detail::table_size(Count);
+    Keyword_Table<E, size> table = {};
+    table.missing = missing;
+
+    for (u32 seed = 1; seed < 100000; seed++) {
+        bool taken[size] = {};
+        bool collided = false;
+        for (size_t i = 0; i < Count && !collided; i++) {
+            size_t length = keywords_detail::constexpr_strlen(keywords[i].name);
+            size_t slot = keywords_detail::hash(keywords[i].name, length, seed) & (size - 1);
+            collided = taken[slot];
+            taken[slot] = true;
+        }
+        if (collided) continue;
+
+        for (size_t i = 0; i < size; i++) {
+            table.names[i] = "";
+            table.lengths[i] = 0;
+            table.values[i] = missing;
+        }
+        for (size_t i = 0; i < Count; i++) {
+            size_t length = keywords_detail::constexpr_strlen(keywords[i].name);
+            size_t slot = keywords_detail::hash(keywords[i].name, length, seed) & (size - 1);
+            table.names[slot] = keywords[i].name;
+            table.lengths[slot] = (u8)length;
+            table.values[slot] = keywords[i].value;
+        }
+        table.seed = seed;
+        table.found_seed = true;
+        return table;
+    }
+
+    return table;
+}
+
+template <typename E, size_t Size>
+inline E keyword_lookup(const Keyword_Table<E, Size> &table, str name) {
+    size_t slot = keywords_detail::hash(name.data, name.length, table.seed) & (Size - 1);
+    if (table.lengths[slot] != name.length || name.length == 0) return table.missing;
+    if (memcmp(table.names[slot], name.data, name.length) != 0) return table.missing;
+    return table.values[slot];
+}
+
+/* Defines a `name` table and checks at compile time that it is perfect. */
+#define KEYWORD_TABLE(name, keywords, missing) \
+    constexpr auto name = make_keyword_table(keywords, missing); \
+    static_assert(name.found_seed, "No perfect hash seed for " #keywords ", hash more bytes")
+
+#endif // KEYWORDS_HPP
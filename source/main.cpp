@@ -10,30 +10,346 @@
 #define STR_IMPLEMENT
 #include "str.hpp"
 
+#include "hash_map.hpp"
 #include "str_to_int.hpp"
+#include "str_to_float.hpp"
+#include "parser.cpp"
+#include "graph.cpp"
+#include "schedule.cpp"
+#include "program.cpp"
+#include "optimize.cpp"
+#include "gvn.cpp"
+#include "dce.cpp"
+#include "codegen.cpp"
+#include "codegen_fixed.cpp"
+#include "interp.cpp"
+#include "jit.cpp"
 
+#define DEFAULT_MODEL "tests/basic.xml"
+#define DEFAULT_MAX_DEPTH 8
 
-int main() {
-    str a = str("alex");
-    str b = str("255");
-    str c = str("256");
-    str d = str("256");
-    str e = str("-10");
-    str f = str("-129");
-
-    u8 a_i, b_i, c_i; s16 d_i; s8 e_i, f_i;
-    auto a_r = str_to_int(a, &a_i);
-    auto b_r = str_to_int(b, &b_i);
-    auto c_r = str_to_int(c, &c_i);
-    auto d_r = str_to_int(d, &d_i);
-    auto e_r = str_to_int(e, &e_i);
-    auto f_r = str_to_int(f, &f_i);
-
-    print("% -> % (%)\n", a, a_i, (u8)a_r);
-    print("% -> % (%)\n", b, b_i, (u8)b_r);
-    print("% -> % (%)\n", c, c_i, (u8)c_r);
-    print("% -> % (%)\n", d, d_i, (u8)d_r);
-    print("% -> % (%)\n", e, e_i, (u8)e_r);
-    print("% -> % (%)\n", f, f_i, (u8)f_r);
-    return 0;
+
+void print_graph(Graph *graph, Intern_Table *symbols) {
+    for (u32 b = 0; b < graph->block_count; b++) {
+        print("block % (SID %, type %) params:", symbol_str(symbols, graph->blocks.name[b]),
+              graph->blocks.sid[b], graph->blocks.type[b]);
+        for (u32 p = graph->blocks.param_offsets[b]; p < graph->blocks.param_offsets[b + 1]; p++) {
+            print(" %", graph->blocks.param_pool[p]);
+        }
+        print("\n");
+    }
+    print("% blocks, % signals driving % inputs\n",
+          graph->block_count, graph->signal_count, graph->fanout_inputs.length);
+}
+
+/* Writes to `path`, or to stdout if there is none. */
+bool write_output(str path, Array<char> *text) {
+    FILE *file = path.length == 0? stdout : fopen(path.data, "wb");
+    if (file == NULL) {
+        fprint(stderr, "ERROR: could not open % for writing\n", path);
+        return false;
+    }
+    bool written = fwrite(text->data, 1, text->length, file) == text->length;
+    if (file != stdout) written &= fclose(file) == 0;
+    if (!written) fprint(stderr, "ERROR: could not write the output\n");
+    return written;
+}
+
+/* Runs the model for `steps` steps in the interpreter, or its machine code if
+ * there's a `jit`, and prints the Outports after each one. Every line of stdin
+ * sets the Inports of one step in the order of their names, an empty line or
+ * the end of the input keeps them. */
+bool simulate(Interp *interp, Jit *jit, u64 steps, str output_path) {
+    FILE *file = output_path.length == 0? stdout : fopen(output_path.data, "wb");
+    if (file == NULL) {
+        fprint(stderr, "ERROR: could not open % for writing\n", output_path);
+        return false;
+    }
+
+    Array<char> out = {};
+    for (Interp_Port *port = interp->ports.data; port->name != NULL; port++) {
+        if (!port->is_input) builder_print(&out, "% ", str_cstr_view((char *)port->name));
+    }
+    if (out.length != 0) out.length--;
+    builder_add(&out, str("\n"));
+
+    if (jit != NULL) jit_init(jit);
+    else interp_init(interp);
+    char *line = NULL;
+    size_t capacity = 0;
+    bool has_input = true;
+    bool failed = false;
+    for (u64 step = 1; step <= steps && !failed; step++) {
+        ssize_t length = has_input? getline(&line, &capacity, stdin) : -1;
+        has_input = length >= 0;
+        str values = has_input? (str){line, (u64)length} : str_NULL;
+        values.data = str_after_whitespace_strip(values.data, values.data + values.length);
+        values.length = has_input? line + length - values.data : 0;
+        for (Interp_Port *port = interp->ports.data; port->name != NULL && values.length != 0 && !failed; port++) {
+            if (!port->is_input) continue;
+            str token = str_tokenize_whitespace(&values);
+            str number = token;
+            if (str_to_float_and_consume(&number, port->value) != S2F_OK || number.length != 0) {
+                fprint(stderr, "ERROR: value '%' for Inport % on line % is not a number\n", token,
+                       str_cstr_view((char *)port->name), step);
+                failed = true;
+            } else if (values.length == 0) {
+                // Every Inport after it needs a value too
+                for (Interp_Port *rest = port + 1; rest->name != NULL; rest++) {
+                    if (!rest->is_input) continue;
+                    fprint(stderr, "ERROR: line % has no value for Inport %\n", step, str_cstr_view((char *)rest->name));
+                    failed = true;
+                    break;
+                }
+            }
+        }
+        if (values.length != 0 && !failed) {
+            fprint(stderr, "ERROR: line % has more values than there are Inports\n", step);
+            failed = true;
+        }
+        if (failed) break;
+
+        if (jit != NULL) jit_step(jit);
+        else interp_step(interp);
+        bool first = true;
+        for (Interp_Port *port = interp->ports.data; port->name != NULL; port++) {
+            if (port->is_input) continue;
+            builder_print(&out, first? "%" : " %", *port->value);
+            first = false;
+        }
+        builder_add(&out, str("\n"));
+        if (out.length >= 64 * 1024) {
+            failed |= fwrite(out.data, 1, out.length, file) != out.length;
+            out.length = 0;
+        }
+    }
+    failed |= fwrite(out.data, 1, out.length, file) != out.length;
+    if (file != stdout) failed |= fclose(file) != 0;
+
+    free(line);
+    array_free(&out);
+    return !failed;
+}
+
+int usage(char *program) {
+    print("Usage: % [options] [model.xml | -] [output.c]\n", program);
+    print("    Compiles the model (% by default) to C, printed if there is no output file.\n", str(DEFAULT_MODEL));
+    print("    --graph        print the lowered graph instead\n");
+    print("    -O0            don't optimize\n");
+    print("    --fast-math    allow optimizations that change the rounding\n");
+    print("    --max-depth N  nest at most N blocks in one C expression, 1 to %, % by default\n",
+          STORAGE_MAX_DEPTH, DEFAULT_MAX_DEPTH);
+    print("    --batch N      N instances as arrays, stepped in a loop by nwocg_generated_step_batch\n");
+    print("                   declared in a header next to the output file\n");
+    print("    --reentrant    no globals, the state is a type passed to the functions,\n");
+    print("                   declared in a header next to the output file\n");
+    print("    --float        single precision arithmetic for blocks without their own OutDataTypeStr\n");
+    print("    --fixed-point  integer code, values in fixed-point formats from their ranges\n");
+    print("    --range NAME LO HI  the range of an Inport or a UnitDelay for --fixed-point\n");
+    print("    --wrap         fixed-point overflows wrap around instead of saturating\n");
+    print("    --simulate N   run N steps in the interpreter instead, a line of Inport values\n");
+    print("                   per step from stdin, prints the Outports\n");
+    print("    --jit          with --simulate, run the step as x86-64 machine code\n");
+    print("    --bytecode     print the interpreter's bytecode instead\n");
+    print("    --output NAME  generate only this Outport and what it needs, can be repeated\n");
+    print("    --stats        report what the optimizations removed to stderr\n");
+    print("    -              read the model from stdin, parsed as it arrives\n");
+    return 1;
+}
+
+int main(int argc, char **argv) {
+    bool only_graph = false;
+    bool optimized = true;
+    bool stats = false;
+    Array<str> outputs = {};
+    Optimize_Options options = {};
+    u32 max_depth = 0;  // the default
+    u32 batch = 0;
+    bool reentrant = false;
+    Precision precision = PRECISION_DOUBLE;
+    bool fixed_point = false;
+    u64 simulate_steps = 0;
+    bool jit = false;
+    bool bytecode = false;
+    bool wrap = false;
+    Array<Range_Bound> ranges = {};
+    str model_path = str(DEFAULT_MODEL);
+    str output_path = {};
+    u32 positional = 0;
+    for (int i = 1; i < argc; i++) {
+        str arg = str_cstr_view(argv[i]);
+        if (arg == str("--graph")) {
+            only_graph = true;
+        } else if (arg == str("-O0")) {
+            optimized = false;
+        } else if (arg == str("--fast-math")) {
+            options.reassociate = true;
+        } else if (arg == str("--stats")) {
+            stats = true;
+        } else if (arg == str("--max-depth") && i + 1 < argc) {
+            str depth = str_cstr_view(argv[++i]);
+            bool valid = str_to_int_and_consume(&depth, &max_depth, 10) == S2I_OK && depth.length == 0;
+            if (!valid || max_depth == 0 || max_depth > STORAGE_MAX_DEPTH) return usage(argv[0]);
+        } else if (arg == str("--batch") && i + 1 < argc) {
+            str count = str_cstr_view(argv[++i]);
+            bool valid = str_to_int_and_consume(&count, &batch, 10) == S2I_OK && count.length == 0;
+            if (!valid || batch == 0) return usage(argv[0]);
+        } else if (arg == str("--reentrant")) {
+            reentrant = true;
+        } else if (arg == str("--float")) {
+            precision = PRECISION_SINGLE;
+        } else if (arg == str("--fixed-point")) {
+            fixed_point = true;
+        } else if (arg == str("--simulate") && i + 1 < argc) {
+            str count = str_cstr_view(argv[++i]);
+            bool valid = str_to_int_and_consume(&count, &simulate_steps, 10) == S2I_OK && count.length == 0;
+            if (!valid || simulate_steps == 0) return usage(argv[0]);
+        } else if (arg == str("--jit")) {
+            jit = true;
+        } else if (arg == str("--bytecode")) {
+            bytecode = true;
+        } else if (arg == str("--wrap")) {
+            wrap = true;
+        } else if (arg == str("--range") && i + 3 < argc) {
+            Range_Bound bound = {str_cstr_view(argv[i + 1]), {0, 0}};
+            str lo = str_cstr_view(argv[i + 2]);
+            str hi = str_cstr_view(argv[i + 3]);
+            i += 3;
+            bool valid = str_to_float_and_consume(&lo, &bound.range.lo) == S2F_OK && lo.length == 0;
+            valid &= str_to_float_and_consume(&hi, &bound.range.hi) == S2F_OK && hi.length == 0;
+            if (!valid || !(bound.range.lo <= bound.range.hi)) return usage(argv[0]);
+            array_add(&ranges, bound);
+        } else if (arg == str("--output") && i + 1 < argc) {
+            array_add(&outputs, str_cstr_view(argv[++i]));
+        } else if (arg.length > 1 && arg[0] == '-') {
+            return usage(argv[0]);
+        } else if (positional == 0) {
+            model_path = arg;
+            positional++;
+        } else if (positional == 1) {
+            output_path = arg;
+            positional++;
+        } else {
+            return usage(argv[0]);
+        }
+    }
+    bool streamed = model_path == str("-");
+    if (streamed && simulate_steps != 0) {
+        fprint(stderr, "ERROR: --simulate reads the Inports from stdin, the model can't come from there too\n");
+        return 1;
+    }
+    if ((batch != 0) + reentrant + fixed_point + (simulate_steps != 0) + bytecode > 1) {
+        fprint(stderr, "ERROR: only one of --batch, --reentrant, --fixed-point, --simulate and --bytecode can be used\n");
+        return 1;
+    }
+    if (jit && simulate_steps == 0) {
+        fprint(stderr, "ERROR: --jit needs --simulate\n");
+        return 1;
+    }
+    if (fixed_point && precision == PRECISION_SINGLE) {
+        fprint(stderr, "ERROR: --float and --fixed-point can't be used together\n");
+        return 1;
+    }
+
+    // The header of the reentrant and batch code is `output.h` for `output.c`
+    str header_path = {};
+    str header_name = {};
+    if ((reentrant || batch != 0) && output_path.length != 0) {
+        str stem = output_path;
+        if (str_endswith(stem, str(".c"))) stem.length -= 2;
+        str parts[] = {stem, str(".h")};
+        header_path = str_add_array(parts, 2);
+        header_name = header_path;
+        for (u64 c = 0; c < header_path.length; c++) {
+            if (header_path[c] == '/' || header_path[c] == '\\') header_name = str_slice(header_path, c + 1, header_path.length);
+        }
+    }
+
+    File_View model = {};
+    if (!streamed) {
+        model = map_entire_file(model_path);
+        if (model.content.data == NULL) return 1;
+    }
+
+    // A streamed model is parsed as it arrives, its names need copies
+    Intern_Table symbols = {};
+    intern_init(&symbols, /*copy_strings*/streamed);
+
+    // The parsed records are only needed until the graph is built
+    Parser parser = {};
+    if (streamed) parser_init_stream(&parser, STDIN_FILENO, &symbols);
+    else parser_init(&parser, model.content, &symbols);
+    Graph graph = {};
+    bool failed = parse(&parser) || graph_build(&graph, &parser);
+    parser_free(&parser);
+
+    Schedule schedule = {};
+    Program program = {};
+    Codegen codegen = {};
+    if (!failed && only_graph) {
+        print_graph(&graph, &symbols);
+    } else if (!failed) {
+        failed = schedule_build(&schedule, &graph, &symbols);
+    }
+    if (!failed && !only_graph) {
+        program_build(&program, &graph, &schedule, precision);
+        program_sort_ports(&program, &symbols);
+        if (outputs.length != 0) failed = program_select_outputs(&program, &symbols, &outputs);
+    }
+    if (!failed && !only_graph) {
+        u64 lowered_ops = program.ops.length;
+        u32 duplicates = 0;
+        Dce_Stats dead = {};
+        if (optimized) {
+            // Folding can make ops equal that weren't, and the other way around
+            duplicates += value_number(&program, options);
+            optimize(&program, options);
+            duplicates += value_number(&program, options);
+        }
+        if (optimized || outputs.length != 0) dead = eliminate_dead(&program);
+        if (stats) {
+            fprint(stderr, "step: % ops lowered, % after optimization, % duplicates and % dead ops removed, % dead states\n",
+                   lowered_ops, program.ops.length, duplicates, dead.ops, dead.states);
+        }
+        // Unoptimized is a statement per block, unless asked otherwise
+        if (max_depth == 0) max_depth = optimized? DEFAULT_MAX_DEPTH : 1;
+        if (simulate_steps != 0 || bytecode) {
+            Interp interp = {};
+            interp_build(&interp, &program, &symbols, options.reassociate);
+            if (bytecode) {
+                interp_print(&interp, &codegen.out);
+                failed = !write_output(output_path, &codegen.out);
+            } else if (jit) {
+                Jit compiled = {};
+                failed = jit_compile(&compiled, &interp);
+                if (!failed) failed = !simulate(&interp, &compiled, simulate_steps, output_path);
+                jit_free(&compiled);
+            } else {
+                failed = !simulate(&interp, NULL, simulate_steps, output_path);
+            }
+            interp_free(&interp);
+        } else {
+            if (fixed_point) {
+                Fixed_Formats formats = {};
+                failed = range_analyze(&formats, &program, &symbols, &ranges);
+                if (!failed) codegen_fixed(&codegen, &program, &symbols, &formats, wrap);
+                fixed_formats_free(&formats);
+            } else {
+                codegen_c(&codegen, &program, &symbols, (Codegen_Options){max_depth, options.reassociate, batch, reentrant, header_name});
+            }
+            if (!failed) failed = !write_output(output_path, &codegen.out);
+            if (!failed && header_path.length != 0) failed = !write_output(header_path, &codegen.header);
+        }
+    }
+
+    array_free(&outputs);
+    array_free(&ranges);
+    str_free(header_path);
+    codegen_free(&codegen);
+    program_free(&program);
+    schedule_free(&schedule);
+    graph_free(&graph);
+    intern_free(&symbols);
+    file_view_free(&model);
+    return failed;
 }
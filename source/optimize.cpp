@@ -0,0 +1,257 @@
+#pragma once
+
+/*
+ * optimize.cpp - folding of constants and of Gain and Sum chains in the step program.
+ *
+ * One pass over the ops in execution order. Every term is looked through
+ * to the op computing its value, and that op is pulled in when it costs
+ * nothing or its result is used only here:
+ *
+ *   x * 1                  becomes x, wherever it's used
+ *   (x * k) * -1, (x * k)  become x * -k and x * k in the single user
+ *   (a + b) + c            becomes a + b + c in the single user
+ *   a constant             becomes part of the op's constant
+ *
+ * By default a rewrite must give bit-identical results: the rounding steps
+ * stay the same, only signs of products are moved around and
+ * multiplications by 1 dropped. So chains are only fused at the front of a
+ * Sum and constants only while nothing else came before them.
+ * With `reassociate` the ops are treated as real arithmetic: Gain chains
+ * become one multiply, any single-use Sum is distributed into its user,
+ * like terms are combined, and zero terms and zero constants are dropped
+ * (which assumes the values are finite).
+ *
+ * Only ops of the same precision are fused, between two precisions there's
+ * a conversion that rounds. A number folded into a single precision op is
+ * rounded to single, which is exactly what its rounding at run time was.
+ *
+ * Ops whose result ends up unused because it was pulled into every user are
+ * removed. Anything that was unused to begin with is left to dead code elimination.
+ */
+
+#include "types.h"
+#include "array.hpp"
+#include "program.cpp"
+
+struct Optimize_Options {
+    bool reassociate;  // -ffast-math style, results may differ in the last bits
+};
+
+namespace optimize_detail {
+
+#define OP_NONE ((u32)-1)
+
+struct Folder {
+    Program *program;
+    Optimize_Options options;
+    Array<u32> def;     // by value, the op computing it or OP_NONE
+    Array<u32> uses;    // by value, terms, updates and ports reading it
+    Array<u8> removed;  // by op
+    Array<Term> terms;  // the rewritten terms of all ops
+    Array<Value> dead;  // worklist of release
+};
+
+/* Drops one use of `value`, removing the op computing it when that was the last one. */
+static void release(Folder *folder, Value value) {
+    array_add(&folder->dead, value);
+    while (folder->dead.length != 0) {
+        Value v = folder->dead[folder->dead.length - 1];
+        folder->dead.length--;
+        if (--folder->uses[v] != 0 || folder->def[v] == OP_NONE) continue;
+
+        u32 op_index = folder->def[v];
+        folder->removed[op_index] = 1;
+        Op *op = &folder->program->ops[op_index];
+        for (u32 t = 0; t < op->term_count; t++) {
+            array_add(&folder->dead, folder->terms[op->first_term + t].value);
+        }
+    }
+}
+
+/* Single term x * 1, nothing added */
+static bool is_alias(Op *op, Term *terms) {
+    return op->term_count == 1 && !op->has_constant && terms[0].scale == 1.0;
+}
+
+struct Builder {
+    Op op;  // the op being rewritten, first_term points into folder->terms
+};
+
+static bool builder_is_empty(Builder *builder) {
+    return builder->op.term_count == 0 && !builder->op.has_constant;
+}
+
+static void add_constant(Builder *builder, f64 value) {
+    Op *op = &builder->op;
+    op->constant = op->has_constant? op->constant + value : value;
+    op->has_constant = true;
+}
+
+/* `new_use` is false when the term is carried over and its use was already counted. */
+static void add_term(Folder *folder, Builder *builder, Term term, bool new_use) {
+    array_add(&folder->terms, term);
+    builder->op.term_count++;
+    folder->uses[term.value] += new_use;
+}
+
+/* Appends `value * scale` to the op, pulling in the op that computes the value if it pays off. */
+static void fold_term(Folder *folder, Builder *builder, Value value, f64 scale) {
+    Program *program = folder->program;
+    bool reassociate = folder->options.reassociate;
+    u32 def = folder->def[value];
+    bool sign_only = scale == 1.0 || scale == -1.0;
+    bool same_precision = program->value_precision[value] == program->value_precision[builder->op.result];
+
+    if (def != OP_NONE && same_precision) {
+        Op *source = &program->ops[def];
+        Term *source_terms = folder->terms.data + source->first_term;
+        bool single_use = folder->uses[value] == 1;
+
+        // A known constant, the product is rounded the same now as at run time
+        bool constant = source->term_count == 0;
+        if (constant && (reassociate || builder_is_empty(builder))) {
+            add_constant(builder, source->constant * scale);
+            release(folder, value);
+            return;
+        }
+
+        bool single_term = source->term_count == 1 && !source->has_constant;
+        bool pull = single_term && (source_terms[0].scale == 1.0 || (single_use && (sign_only || reassociate)));
+        // The whole Sum in place of the term, it's rounded the same if it comes first.
+        // Not negated though: -(a - a) is -0 but -a + a is +0
+        pull |= !constant && !single_term && single_use && (reassociate || (scale == 1.0 && builder_is_empty(builder)));
+
+        if (pull) {
+            if (source->has_constant) add_constant(builder, source->constant * scale);
+            for (u32 t = 0; t < source->term_count; t++) {
+                Term inner = folder->terms[source->first_term + t];
+                add_term(folder, builder, (Term){inner.value, inner.scale * scale}, /*new_use*/true);
+            }
+            release(folder, value);
+            return;
+        }
+    }
+
+    add_term(folder, builder, (Term){value, scale}, /*new_use*/false);
+}
+
+/* Real arithmetic only: like terms combined, zeros dropped. */
+static void combine_terms(Folder *folder, Builder *builder) {
+    Op *op = &builder->op;
+    Term *terms = folder->terms.data + op->first_term;
+    u32 kept = 0;
+    for (u32 t = 0; t < op->term_count; t++) {
+        Term term = terms[t];
+        u32 same = 0;
+        while (same < kept && terms[same].value != term.value) same++;
+        if (same < kept) {
+            terms[same].scale += term.scale;
+            release(folder, term.value);
+        } else {
+            terms[kept++] = term;
+        }
+    }
+
+    u32 nonzero = 0;
+    for (u32 t = 0; t < kept; t++) {
+        if (terms[t].scale == 0.0) release(folder, terms[t].value);
+        else terms[nonzero++] = terms[t];
+    }
+    op->term_count = nonzero;
+    folder->terms.length = op->first_term + nonzero;
+
+    if (op->has_constant && op->constant == 0.0 && op->term_count != 0) op->has_constant = false;
+}
+
+/* Scales and the constant made by folding as numbers of the op's precision. */
+static void round_numbers(Folder *folder, Builder *builder) {
+    Op *op = &builder->op;
+    Precision precision = (Precision)folder->program->value_precision[op->result];
+    Term *terms = folder->terms.data + op->first_term;
+    for (u32 t = 0; t < op->term_count; t++) terms[t].scale = precision_round(precision, terms[t].scale);
+    op->constant = precision_round(precision, op->constant);
+}
+
+/* The value a port or an update can read instead of `value`, through aliases
+ * of the same precision. Not a state, those are read after the updates. */
+static Value resolve(Folder *folder, Value value) {
+    Program *program = folder->program;
+    while (folder->def[value] != OP_NONE) {
+        Op *op = &program->ops[folder->def[value]];
+        Term *terms = folder->terms.data + op->first_term;
+        if (!is_alias(op, terms)) break;
+        if (program->value_kind[terms[0].value] == VALUE_STATE) break;
+        if (program->value_precision[terms[0].value] != program->value_precision[value]) break;
+        folder->uses[terms[0].value]++;
+        Value next = terms[0].value;
+        release(folder, value);
+        value = next;
+    }
+    return value;
+}
+
+} // namespace optimize_detail
+
+void optimize(Program *program, Optimize_Options options) {
+    using namespace optimize_detail;
+
+    Folder folder = {};
+    folder.program = program;
+    folder.options = options;
+    u32 value_count = program_value_count(program);
+    array_reserve(&folder.def, value_count);
+    array_reserve(&folder.uses, value_count);
+    for (Value v = 0; v < value_count; v++) {
+        array_add(&folder.def, (u32)OP_NONE);
+        array_add(&folder.uses, 0u);
+    }
+    for (u32 i = 0; i < program->ops.length; i++) {
+        Op *op = &program->ops[i];
+        folder.def[op->result] = i;
+        for (u32 t = 0; t < op->term_count; t++) folder.uses[op_terms(program, op)[t].value]++;
+        array_add(&folder.removed, (u8)0);
+    }
+    for (Update &update : program->updates) folder.uses[update.source]++;
+    for (Ext_Port &port : program->ports) folder.uses[port.value]++;
+
+    // The producers come first, so every term is folded against a finished op
+    array_reserve(&folder.terms, program->terms.length);
+    for (u32 i = 0; i < program->ops.length; i++) {
+        Op *op = &program->ops[i];
+        Builder builder = {*op};
+        builder.op.first_term = (u32)folder.terms.length;
+        builder.op.term_count = 0;
+
+        for (u32 t = 0; t < op->term_count; t++) {
+            Term term = program->terms[op->first_term + t];
+            fold_term(&folder, &builder, term.value, term.scale);
+        }
+        if (options.reassociate) combine_terms(&folder, &builder);
+        round_numbers(&folder, &builder);
+        *op = builder.op;
+    }
+
+    for (Update &update : program->updates) update.source = resolve(&folder, update.source);
+    for (Ext_Port &port : program->ports) port.value = resolve(&folder, port.value);
+
+    // Compact
+    u32 kept = 0;
+    Array<Term> terms = {};
+    for (u32 i = 0; i < program->ops.length; i++) {
+        if (folder.removed[i]) continue;
+        Op op = program->ops[i];
+        u32 first = (u32)terms.length;
+        array_add_range(&terms, folder.terms.data + op.first_term, op.term_count);
+        op.first_term = first;
+        program->ops[kept++] = op;
+    }
+    program->ops.length = kept;
+    array_free(&program->terms);
+    program->terms = terms;
+
+    array_free(&folder.def);
+    array_free(&folder.uses);
+    array_free(&folder.removed);
+    array_free(&folder.terms);
+    array_free(&folder.dead);
+}
@@ -1,4 +1,22 @@
+#pragma once
+
 #include <stdbool.h>
+#include <ctype.h>
+#include <vector>
+#include <unistd.h>
+#include <errno.h>
+
+#include "types.h"
+#include "array.hpp"
+#include "hash_map.hpp"
+#include "arena.hpp"
+#include "str.hpp"
+#include "print.hpp"
+#include "str_to_int.hpp"
+#include "xml_index.hpp"
+#include "keywords.hpp"
+#include "intern.hpp"
+#include "endpoint.hpp"
 
 enum Parsed {
     GOOD  = 0,
@@ -15,30 +33,485 @@ enum Block_Type {
     COUNT    = 5,
 };
 
+constexpr Keyword<Block_Type> block_type_keywords[] = {
+    {"Inport",    IN_PORT},
+    {"Sum",       SUM},
+    {"Gain",      GAIN},
+    {"UnitDelay", DELAY},
+    {"Outport",   OUT_PORT},
+};
+KEYWORD_TABLE(block_type_table, block_type_keywords, COUNT);
+
+enum Tag_Name {
+    TAG_BLOCK,
+    TAG_LINE,
+    TAG_BRANCH,
+    TAG_P,
+    TAG_UNKNOWN,
+};
+
+constexpr Keyword<Tag_Name> tag_keywords[] = {
+    {"Block",  TAG_BLOCK},
+    {"Line",   TAG_LINE},
+    {"Branch", TAG_BRANCH},
+    {"P",      TAG_P},
+};
+KEYWORD_TABLE(tag_table, tag_keywords, TAG_UNKNOWN);
+
+enum Attribute_Name {
+    ATTR_BLOCK_TYPE,
+    ATTR_NAME,
+    ATTR_SID,
+    ATTR_UNKNOWN,
+};
+
+constexpr Keyword<Attribute_Name> attribute_keywords[] = {
+    {"BlockType", ATTR_BLOCK_TYPE},
+    {"Name",      ATTR_NAME},
+    {"SID",       ATTR_SID},
+};
+KEYWORD_TABLE(attribute_table, attribute_keywords, ATTR_UNKNOWN);
+
+/* Known values of <P Name="..."> */
+enum Param_Key {
+    P_NAME,
+    P_POSITION,
+    P_PORTS,
+    P_PORT,
+    P_PORT_NUMBER,
+    P_ICON_SHAPE,
+    P_INPUTS,
+    P_GAIN,
+    P_SAMPLE_TIME,
+    P_INITIAL_CONDITION,
+    P_SRC,
+    P_DST,
+    P_POINTS,
+    P_OUT_DATA_TYPE,
+    P_UNKNOWN,
+};
+
+constexpr Keyword<Param_Key> param_keywords[] = {
+    {"Name",             P_NAME},
+    {"Position",         P_POSITION},
+    {"Ports",            P_PORTS},
+    {"Port",             P_PORT},
+    {"PortNumber",       P_PORT_NUMBER},
+    {"IconShape",        P_ICON_SHAPE},
+    {"Inputs",           P_INPUTS},
+    {"Gain",             P_GAIN},
+    {"SampleTime",       P_SAMPLE_TIME},
+    {"InitialCondition", P_INITIAL_CONDITION},
+    {"Src",              P_SRC},
+    {"Dst",              P_DST},
+    {"Points",           P_POINTS},
+    {"OutDataTypeStr",   P_OUT_DATA_TYPE},
+};
+KEYWORD_TABLE(param_table, param_keywords, P_UNKNOWN);
+
+/* <P Name="name">value</P> */
+struct Param {
+    Param_Key key;  // P_UNKNOWN for names we don't know, `name` still has it
+    str name;
+    str value;
+};
+
+/* Arrays live in the parser's arena. */
+
 struct Block {
-    
+    Block_Type type;
+    Symbol name;
+    u32 sid;
+    Array<Param> params;
+};
+
+struct Line {
+    Symbol name;
+    str src;
+    Array<str> dsts;  // Dst of the line itself and of all of its (nested) Branches
+};
+
+/* A port of a block by its dense index in Parser::blocks, ports are 1-based like in the model. */
+struct Port_Ref {
+    u32 block;
+    u16 port;
+};
+
+inline u64 port_key(u32 block, u16 port) {
+    return ((u64)block << 16) | port;
+}
+
+enum Element_Kind {
+    ELEMENT_BLOCK,
+    ELEMENT_LINE,
+};
+
+/* One top-level child of <System>, only the field matching `kind` is filled. */
+struct Element {
+    Element_Kind kind;
+    Block block;
+    Line line;
+};
+
+#define PARSER_STREAM_WINDOW (64 * 1024)
+
+/* Input that arrives in windows from a pipe, stdin or a socket.
+ * The buffer only holds the unparsed tail, so it grows
+ * up to the largest single element, not the whole model. */
+struct Parser_Stream {
+    int fd;
+    char *buffer;
+    u64 capacity;
+    bool finished;  // got EOF, `buffer` has everything that's left
 };
 
+/* All str's handed out by the parser are slices of the input.
+ * In streaming mode the input is a moving window and the arena is reset
+ * for every element, so elements stay valid only until the next parser_next. */
 struct Parser {
+    str input;
+    char *pos;
+    Xml_Index index;
+    Arena arena;
+    Arena kept;              // streamed elements collected by parse, copied out of the window
+    Intern_Table *symbols;   // block and line names, owned by the caller
     std::vector<Block> blocks;
-    bool parsed_attributes;
-    // str tag_name;
-    // str attr_name;
-    // str attr_value;
+    std::vector<Line> lines;
+
+    // Filled by parse, a signal is a block output with everything it drives
+    Hash_Map<u32, u32> block_by_sid;      // SID -> index in `blocks`
+    Hash_Map<u64, u32> signal_by_output;  // port_key of an output -> signal
+    Hash_Map<u64, u32> signal_by_input;   // port_key of an input -> its only driver
+    Array<Port_Ref> signals;              // the output behind each signal
+
+    bool parsed_attributes;  // '>' of the current start tag was consumed
+    bool self_closing;       // the current start tag ended with '/>'
+    bool in_system;          // <System> start tag was consumed
+    bool truncated;          // ran into the end of the input, when streaming more may come
+    bool quiet;              // don't report errors, the element may be incomplete
+    Parser_Stream *stream;   // NULL if the whole input is in memory
 };
 
 #define report_error(fmt, ...) \
-    printf("ERROR: " fmt "\n", ...)
+    fprint(stderr, "ERROR: " fmt "\n" __VA_OPT__(,) __VA_ARGS__)
+
+/* Errors of the parser are muted while they may be bogus, e.g. the streamed element is cut off and will be retried. */
+#define parser_error(parser, fmt, ...) \
+    do { if (!(parser)->quiet) report_error(fmt __VA_OPT__(,) __VA_ARGS__); } while (0)
+
+/* In streaming mode `symbols` must copy the strings, the input window moves. */
+void parser_init(Parser *parser, str input, Intern_Table *symbols) {
+    parser->input = input;
+    parser->symbols = symbols;
+    parser->pos = input.data;
+    xml_index_init(&parser->index, input);
+    parser->parsed_attributes = true;
+    parser->self_closing = false;
+    parser->in_system = false;
+    parser->truncated = false;
+    parser->quiet = false;
+    parser->stream = NULL;
+}
+
+/* Pull elements with parser_next as they arrive on `fd`. */
+void parser_init_stream(Parser *parser, int fd, Intern_Table *symbols) {
+    Parser_Stream *stream = (Parser_Stream *)malloc(sizeof(Parser_Stream));
+    assert((stream != NULL) && "Buy more RAM lol!");
+    stream->fd = fd;
+    stream->capacity = PARSER_STREAM_WINDOW;
+    stream->buffer = (char *)malloc(stream->capacity);
+    assert((stream->buffer != NULL) && "Buy more RAM lol!");
+    stream->finished = false;
+
+    parser_init(parser, (str){stream->buffer, 0}, symbols);
+    parser->stream = stream;
+}
+
+void parser_free(Parser *parser) {
+    arena_free(&parser->arena);
+    arena_free(&parser->kept);
+    hash_map_free(&parser->block_by_sid);
+    hash_map_free(&parser->signal_by_output);
+    hash_map_free(&parser->signal_by_input);
+    array_free(&parser->signals);
+    parser->blocks.clear();
+    parser->lines.clear();
+    xml_index_free(&parser->index);
+    if (parser->stream) {
+        free(parser->stream->buffer);
+        free(parser->stream);
+        parser->stream = NULL;
+    }
+}
+
+static char *parser_end(Parser *parser) {
+    return parser->input.data + parser->input.length;
+}
+
+static bool is_name_char(char c) {
+    return !isspace(c) && c != '=' && c != '>' && c != '/' && c != '<' && c != '"';
+}
+
+/* Finding nothing before the end, the input may be cut off there. */
+static char *find_or_truncated(Parser *parser, char *from, char c) {
+    char *found = xml_index_find(&parser->index, from, c);
+    if (found == NULL) parser->truncated = true;
+    return found;
+}
+
+/* Is there no more input at `pos`? The input may be cut off there. */
+static bool at_end(Parser *parser) {
+    if (parser->pos < parser_end(parser)) return false;
+    parser->truncated = true;
+    return true;
+}
+
+static str take_name(Parser *parser) {
+    char *start = parser->pos;
+    char *end = parser_end(parser);
+    while (parser->pos < end && is_name_char(*parser->pos)) parser->pos++;
+    if (parser->pos == end) parser->truncated = true;  // the name may go on
+    return (str){start, (u64)(parser->pos - start)};
+}
+
+static void skip_whitespace(Parser *parser) {
+    parser->pos = str_after_whitespace_strip(parser->pos, parser_end(parser));
+}
+
+/* Skips "<?...?>" and "<!--...-->", `pos` is right after the '<'. */
+static Parsed skip_special_tag(Parser *parser) {
+    char *end = parser_end(parser);
+    bool is_comment = (end - parser->pos >= 3) && memcmp(parser->pos, "!--", 3) == 0;
+
+    char *close = find_or_truncated(parser, parser->pos, '>');
+    while (close != NULL) {
+        if (!is_comment) break;
+        if (close - parser->pos >= 5 && close[-1] == '-' && close[-2] == '-') break;
+        close = find_or_truncated(parser, close + 1, '>');
+    }
+
+    if (close == NULL) {
+        parser_error(parser, "unterminated <% tag", is_comment? str("!--") : str("?"));
+        return ERROR;
+    }
+    parser->pos = close + 1;
+    return GOOD;
+}
 
-Parsed parse_block(Parser *parser) {
+/* Finds the next tag, skipping text, comments and processing instructions.
+ * On GOOD `pos` is right after the '<'. */
+static Parsed next_tag(Parser *parser) {
+    while (1) {
+        char *open = find_or_truncated(parser, parser->pos, '<');
+        if (open == NULL) {
+            parser_error(parser, "unexpected end of input, expected a tag");
+            return ERROR;
+        }
+        parser->pos = open + 1;
+        if (parser->pos < parser_end(parser) && (*parser->pos == '?' || *parser->pos == '!')) {
+            if (skip_special_tag(parser)) return ERROR;
+            continue;
+        }
+        return GOOD;
+    }
+}
+
+Parsed xml_header(Parser *parser) {
+    skip_whitespace(parser);
+    if (str_startswith((str){parser->pos, (u64)(parser_end(parser) - parser->pos)}, str("<?xml"))) {
+        parser->pos++;
+        return skip_special_tag(parser);
+    }
+    return GOOD;
+}
+
+/* Reads "<name", the attributes are left for tag_attribute. */
+Parsed start_tag(Parser *parser, str *name) {
+    if (next_tag(parser)) return ERROR;
+    if (!at_end(parser) && *parser->pos == '/') {
+        parser_error(parser, "expected a start tag, got an end tag");
+        return ERROR;
+    }
+    *name = take_name(parser);
+    if (name->length == 0) {
+        parser_error(parser, "tag without a name");
+        return ERROR;
+    }
+    parser->parsed_attributes = false;
+    parser->self_closing = false;
+    return GOOD;
+}
+
+/* Reads one name="value" pair of the current start tag.
+ * Returns NEXT and consumes the '>' when there are no more attributes. */
+Parsed tag_attribute(Parser *parser, str *name, str *value) {
+    if (parser->parsed_attributes) return NEXT;
+
+    skip_whitespace(parser);
+    if (at_end(parser)) {
+        parser_error(parser, "unexpected end of input inside a tag");
+        return ERROR;
+    }
+
+    if (*parser->pos == '>' || *parser->pos == '/') {
+        parser->self_closing = *parser->pos == '/';
+        parser->pos += parser->self_closing;
+        if (at_end(parser) || *parser->pos != '>') {
+            parser_error(parser, "expected '>' after '/' in a tag");
+            return ERROR;
+        }
+        parser->pos++;
+        parser->parsed_attributes = true;
+        return NEXT;
+    }
+
+    *name = take_name(parser);
+    if (name->length == 0) {
+        parser_error(parser, "expected an attribute name, got '%'", (str){parser->pos, 1});
+        return ERROR;
+    }
+
+    skip_whitespace(parser);
+    if (at_end(parser) || *parser->pos != '=') {
+        parser_error(parser, "expected '=' after attribute %", *name);
+        return ERROR;
+    }
+    parser->pos++;
+    skip_whitespace(parser);
+    if (at_end(parser) || *parser->pos != '"') {
+        parser_error(parser, "expected '\"' to start the value of attribute %", *name);
+        return ERROR;
+    }
+
+    char *close = find_or_truncated(parser, parser->pos + 1, '"');
+    if (close == NULL) {
+        parser_error(parser, "unterminated value of attribute %", *name);
+        return ERROR;
+    }
+    *value = (str){parser->pos + 1, (u64)(close - parser->pos - 1)};
+    parser->pos = close + 1;
+    return GOOD;
+}
+
+static Parsed skip_attributes(Parser *parser) {
+    while (1) {
+        str name = {0};
+        str value = {0};
+        Parsed result = tag_attribute(parser, &name, &value);
+        if (result == ERROR) return ERROR;
+        if (result == NEXT) return GOOD;
+    }
+}
+
+/* Text between the current start tag and the next tag. */
+Parsed tag_text(Parser *parser, str *text) {
+    if (skip_attributes(parser)) return ERROR;
+    if (parser->self_closing) {
+        *text = (str){parser->pos, 0};
+        return GOOD;
+    }
+
+    char *open = find_or_truncated(parser, parser->pos, '<');
+    if (open == NULL) {
+        parser_error(parser, "unexpected end of input, expected an end tag");
+        return ERROR;
+    }
+    *text = (str){parser->pos, (u64)(open - parser->pos)};
+    parser->pos = open;
+    return GOOD;
+}
+
+/* Reads "</name>" of the current element.
+ * Returns NEXT without consuming anything if the next tag is a start tag. */
+Parsed end_tag(Parser *parser, str *name) {
+    if (skip_attributes(parser)) return ERROR;
+    if (parser->self_closing) {
+        parser->self_closing = false;
+        return GOOD;
+    }
+
+    char *before = parser->pos;
+    if (next_tag(parser)) return ERROR;
+    if (at_end(parser) || *parser->pos != '/') {
+        parser->pos = before;
+        return NEXT;
+    }
+    parser->pos++;
+
+    str end_name = take_name(parser);
+    if (!(end_name == *name)) {
+        parser_error(parser, "end tag % does not match start tag %", end_name, *name);
+        return ERROR;
+    }
+    skip_whitespace(parser);
+    if (at_end(parser) || *parser->pos != '>') {
+        parser_error(parser, "expected '>' to close end tag %", end_name);
+        return ERROR;
+    }
+    parser->pos++;
+    return GOOD;
+}
+
+/* Skips the rest of the current element, including all children. */
+static Parsed skip_element(Parser *parser, str name) {
+    while (1) {
+        Parsed result = end_tag(parser, &name);
+        if (result == GOOD) return GOOD;
+        if (result == ERROR) return ERROR;
+
+        str child = {0};
+        if (start_tag(parser, &child)) return ERROR;
+        if (skip_element(parser, child)) return ERROR;
+    }
+}
+
+/* Reads <P Name="name">value</P>, the "<P" is already consumed. */
+static Parsed parse_param(Parser *parser, Param *param) {
+    *param = (Param){};
+    while (1) {
+        str name = {0};
+        str value = {0};
+        Parsed result = tag_attribute(parser, &name, &value);
+        if (result == ERROR) return ERROR;
+        if (result == NEXT) break;
+
+        if (keyword_lookup(attribute_table, name) == ATTR_NAME) {
+            param->name = value;
+        }
+    }
+
+    if (param->name.length == 0) {
+        parser_error(parser, "P tag without a Name");
+        return ERROR;
+    }
+    param->key = keyword_lookup(param_table, param->name);
+    if (tag_text(parser, &param->value)) return ERROR;
+
+    str tag = str("P");
+    return end_tag(parser, &tag);
+}
+
+Param *block_param(Block *block, Param_Key key) {
+    for (Param &param : block->params) {
+        if (param.key == key) return &param;
+    }
+    return NULL;
+}
+
+Block_Type str_to_block_type(str name) {
+    return keyword_lookup(block_type_table, name);
+}
+
+Parsed parse_block(Parser *parser, Block *out) {
     if (parser->parsed_attributes) {
-        report_error("block has no attributes, but it should have BlockType, Name and SID");
+        parser_error(parser, "block has no attributes, but it should have BlockType, Name and SID");
         return ERROR;
     }
 
-    Block_Type block_type = COUNT;
-    str        block_name = {0};
-    u16        block_id   = -1;
+    Block block = {COUNT, SYMBOL_NONE, (u32)-1, {}};
+    str block_name = {0};
+    str block_type = {0};
+    bool has_sid = false;
     while (1) {
         str name = {0};
         str value = {0};
@@ -46,47 +519,328 @@ Parsed parse_block(Parser *parser) {
         if (result == ERROR) return ERROR;
         if (result == NEXT) break;
 
-        if (name == "BlockType") {
-            block_type = str_to_block_type(value);
-        } else if (name == "Name") {
+        switch (keyword_lookup(attribute_table, name)) {
+        case ATTR_BLOCK_TYPE:
+            block_type = value;
+            block.type = str_to_block_type(value);
+            break;
+        case ATTR_NAME:
             block_name = value;
-        } else if (name == "SID") {
-            if (str_to_int(*value, &block_id)) return ERROR;
+            break;
+        case ATTR_SID:
+            if (str_to_int(value, &block.sid)) {
+                parser_error(parser, "block SID must be a non-negative integer, got %", value);
+                return ERROR;
+            }
+            has_sid = true;
+            break;
+        case ATTR_UNKNOWN:
+            break;
+        }
+    }
+
+    if (block.type == COUNT) {
+        parser_error(parser, "block % has unsupported BlockType '%'", block_name, block_type);
+        return ERROR;
+    }
+    if (!has_sid) {
+        parser_error(parser, "block % has no SID", block_name);
+        return ERROR;
+    }
+    block.name = intern(parser->symbols, block_name);
+
+    str tag = str("Block");
+    while (1) {
+        Parsed result = end_tag(parser, &tag);
+        if (result == ERROR) return ERROR;
+        if (result == GOOD) break;
+
+        str child = {0};
+        if (start_tag(parser, &child)) return ERROR;
+        if (keyword_lookup(tag_table, child) == TAG_P) {
+            Param param = {};
+            if (parse_param(parser, &param)) return ERROR;
+            array_add(&block.params, param, &parser->arena);
         } else {
-            
+            if (skip_element(parser, child)) return ERROR;
         }
     }
 
+    *out = block;
+    return GOOD;
+}
 
-    if (type == COUNT) return ERROR;
+/* Line and Branch bodies look the same, Src is only allowed in the Line. */
+static Parsed parse_line_body(Parser *parser, Line *line, str tag, bool is_branch) {
+    while (1) {
+        Parsed result = end_tag(parser, &tag);
+        if (result == ERROR) return ERROR;
+        if (result == GOOD) return GOOD;
 
+        str child = {0};
+        if (start_tag(parser, &child)) return ERROR;
+        Tag_Name tag_name = keyword_lookup(tag_table, child);
+        if (tag_name == TAG_P) {
+            Param param = {};
+            if (parse_param(parser, &param)) return ERROR;
+            if (param.key == P_DST) {
+                array_add(&line->dsts, param.value, &parser->arena);
+            } else if (!is_branch && param.key == P_SRC) {
+                line->src = param.value;
+            } else if (!is_branch && param.key == P_NAME) {
+                line->name = intern(parser->symbols, param.value);
+            }
+        } else if (tag_name == TAG_BRANCH) {
+            if (skip_attributes(parser)) return ERROR;
+            if (parse_line_body(parser, line, child, true)) return ERROR;
+        } else {
+            if (skip_element(parser, child)) return ERROR;
+        }
+    }
 }
 
-Parsed parse(Parser *parser) {
-    if (xml_header(parser)) return ERRPR;
+Parsed parse_line(Parser *parser, Line *out) {
+    if (skip_attributes(parser)) return ERROR;
+
+    Line line = {SYMBOL_NONE, str_NULL, {}};
+    if (parse_line_body(parser, &line, str("Line"), false)) return ERROR;
+
+    if (line.src.length == 0) {
+        parser_error(parser, "line % has no Src", symbol_str(parser->symbols, line.name));
+        return ERROR;
+    }
+    if (line.dsts.length == 0) {
+        parser_error(parser, "line from % has no Dst", line.src);
+        return ERROR;
+    }
+
+    *out = line;
+    return GOOD;
+}
+
+static Parsed parse_prologue(Parser *parser) {
+    if (xml_header(parser)) return ERROR;
+
+    str system = {0};
+    if (start_tag(parser, &system)) return ERROR;
+    if (!(system == str("System"))) {
+        parser_error(parser, "root tag must be System, got %", system);
+        return ERROR;
+    }
+    if (skip_attributes(parser)) return ERROR;
+
+    parser->in_system = true;
+    return GOOD;
+}
+
+/* Returns NEXT after </System>. */
+static Parsed parse_element(Parser *parser, Element *element) {
+    if (!parser->in_system) {
+        if (parse_prologue(parser)) return ERROR;
+    }
+
+    str system = str("System");
+    Parsed result = end_tag(parser, &system);
+    if (result == ERROR) return ERROR;
+    if (result == GOOD) return NEXT;
 
     str name = {0};
     if (start_tag(parser, &name)) return ERROR;
 
-    while (end_tag(parser, &name) == ERROR) {
-        str name = {0};
-        if (start_tag(parser, &name)) return ERROR;
+    switch (keyword_lookup(tag_table, name)) {
+    case TAG_BLOCK:
+        element->kind = ELEMENT_BLOCK;
+        return parse_block(parser, &element->block);
+    case TAG_LINE:
+        element->kind = ELEMENT_LINE;
+        return parse_line(parser, &element->line);
+    default:
+        break;
+    }
 
-        if (name == "Block") {
-            if (parse_block(parser)) return ERROR;
-        } else if (name == "Line") {
-            if (parse_line(parser);
-        } else {
-            report_error("tag %s is not expected, only Block and Line are", name);
+    parser_error(parser, "tag % is not expected, only Block and Line are", name);
+    return ERROR;
+}
+
+/* Moves the unparsed tail to the front of the buffer and reads more after it.
+ * Reads at least as much as is already buffered, so an element that spans
+ * many windows is re-parsed only a logarithmic number of times. */
+static Parsed stream_read_more(Parser *parser) {
+    Parser_Stream *stream = parser->stream;
+
+    u64 kept = parser_end(parser) - parser->pos;
+    memmove(stream->buffer, parser->pos, kept);
+
+    u64 wanted = kept < PARSER_STREAM_WINDOW? PARSER_STREAM_WINDOW : kept;
+    if (stream->capacity < kept + wanted) {
+        stream->capacity = kept + wanted;
+        stream->buffer = (char *)realloc(stream->buffer, stream->capacity);
+        assert((stream->buffer != NULL) && "Buy more RAM lol!");
+    }
+
+    u64 length = kept;
+    while (length < kept + wanted) {
+        ssize_t got = read(stream->fd, stream->buffer + length, stream->capacity - length);
+        if (got < 0 && errno == EINTR) continue;
+        if (got < 0) {
+            parser_error(parser, "could not read the model: %", str_cstr_view(strerror(errno)));
+            return ERROR;
+        }
+        if (got == 0) {
+            stream->finished = true;
+            break;
+        }
+        length += got;
+        // Don't wait for a full window from a slow producer, unless the element is big
+        if (kept < PARSER_STREAM_WINDOW) break;
+    }
+
+    parser->input = (str){stream->buffer, length};
+    parser->pos = stream->buffer;
+    xml_index_init(&parser->index, parser->input);
+    return GOOD;
+}
+
+/* Pulls the next Block or Line. Returns NEXT after </System>.
+ * In streaming mode an element is returned as soon as its end tag arrives. */
+Parsed parser_next(Parser *parser, Element *element) {
+    *element = (Element){};
+    if (parser->stream == NULL) return parse_element(parser, element);
+
+    // The previous element is dead by now
+    arena_reset(&parser->arena, (Arena_Mark){});
+
+    while (1) {
+        char *start = parser->pos;
+        bool in_system = parser->in_system;
+
+        // Until EOF an error that ran into the end of the window might just mean the element is cut off
+        parser->quiet = !parser->stream->finished;
+        parser->truncated = false;
+        Parsed result = parse_element(parser, element);
+        parser->quiet = false;
+        if (result != ERROR || parser->stream->finished) return result;
+
+        arena_reset(&parser->arena, (Arena_Mark){});
+        *element = (Element){};
+        parser->pos = start;
+        parser->in_system = in_system;
+        parser->parsed_attributes = true;
+        parser->self_closing = false;
+        // A syntax error in what's there already, parsed again to report it
+        if (!parser->truncated) {
+            xml_index_init(&parser->index, parser->input);  // it only goes forward
+            return parse_element(parser, element);
+        }
+        if (stream_read_more(parser)) return ERROR;
+    }
+}
+
+static Parsed resolve_endpoint(Parser *parser, str text, Endpoint endpoint,
+                               Endpoint_Direction direction, Port_Ref *ref) {
+    if (endpoint.direction != direction) {
+        parser_error(parser, "% must be an %", text, direction == ENDPOINT_IN? str("input") : str("output"));
+        return ERROR;
+    }
+
+    u32 *block = hash_map_get(&parser->block_by_sid, endpoint.sid);
+    if (block == NULL) {
+        parser_error(parser, "% refers to a block with SID % that does not exist", text, endpoint.sid);
+        return ERROR;
+    }
+    *ref = (Port_Ref){*block, endpoint.port};
+    return GOOD;
+}
+
+/* Wires every Line's Src and Dst's to signals, linear in the number of endpoints. */
+Parsed parser_link(Parser *parser) {
+    hash_map_reserve(&parser->signal_by_output, parser->lines.size());
+    hash_map_reserve(&parser->signal_by_input, parser->lines.size());
+
+    Array<Endpoint> dsts = {};
+    Arena_Mark mark = arena_mark(&parser->arena);
+
+    for (Line &line : parser->lines) {
+        Endpoint src_endpoint;
+        if (!endpoint_decode(line.src, &src_endpoint)) {
+            parser_error(parser, "expected SID#out:N, got %", line.src);
+            return ERROR;
+        }
+        Port_Ref src;
+        if (resolve_endpoint(parser, line.src, src_endpoint, ENDPOINT_OUT, &src)) return ERROR;
+
+        bool added;
+        u32 signal = *hash_map_get_or_add(&parser->signal_by_output, port_key(src.block, src.port),
+                                          (u32)parser->signals.length, &added);
+        if (added) array_add(&parser->signals, src);
+
+        dsts.length = 0;
+        array_reserve_to_add(&dsts, line.dsts.length, &parser->arena);
+        u64 decoded = endpoint_decode_batch(line.dsts.data, line.dsts.length, dsts.data);
+        if (decoded != line.dsts.length) {
+            parser_error(parser, "expected SID#in:N, got %", line.dsts[decoded]);
             return ERROR;
         }
+        dsts.length = decoded;
 
-        if (end_tag(parser, &name)) return ERROR;
-        // ^ if (parser->tag_name != tag_name) {
-        //     printf("ERROR" End tag name does not match start tag name\n");
-        //     return ERROR;
-        // }
+        for (u64 i = 0; i < dsts.length; i++) {
+            Port_Ref dst;
+            if (resolve_endpoint(parser, line.dsts[i], dsts[i], ENDPOINT_IN, &dst)) return ERROR;
+
+            hash_map_get_or_add(&parser->signal_by_input, port_key(dst.block, dst.port), signal, &added);
+            if (!added) {
+                parser_error(parser, "% is driven by more than one line", line.dsts[i]);
+                return ERROR;
+            }
+        }
     }
 
+    arena_reset(&parser->arena, mark);
     return GOOD;
 }
+
+/* A streamed element only lives until the next parser_next, this copies its
+ * strings and arrays to the `kept` arena. */
+static void keep_element(Parser *parser, Element *element) {
+    Arena *kept = &parser->kept;
+    if (element->kind == ELEMENT_BLOCK) {
+        Array<Param> params = {};
+        array_reserve_to_add(&params, element->block.params.length, kept);
+        for (Param &param : element->block.params) {
+            array_add(&params, (Param){param.key, str_copy_arena(kept, param.name), str_copy_arena(kept, param.value)}, kept);
+        }
+        element->block.params = params;
+    } else {
+        Array<str> dsts = {};
+        array_reserve_to_add(&dsts, element->line.dsts.length, kept);
+        for (str dst : element->line.dsts) array_add(&dsts, str_copy_arena(kept, dst), kept);
+        element->line.src = str_copy_arena(kept, element->line.src);
+        element->line.dsts = dsts;
+    }
+}
+
+/* Collects the whole model into `blocks` and `lines` and links them.
+ * A streamed model is collected as it arrives. */
+Parsed parse(Parser *parser) {
+    while (1) {
+        Element element = {};
+        Parsed result = parser_next(parser, &element);
+        if (result == ERROR) return ERROR;
+        if (result == NEXT) break;
+        if (parser->stream != NULL) keep_element(parser, &element);
+
+        if (element.kind == ELEMENT_BLOCK) {
+            bool added;
+            hash_map_get_or_add(&parser->block_by_sid, element.block.sid, (u32)parser->blocks.size(), &added);
+            if (!added) {
+                parser_error(parser, "two blocks have the same SID %", element.block.sid);
+                return ERROR;
+            }
+            parser->blocks.push_back(element.block);
+        } else {
+            parser->lines.push_back(element.line);
+        }
+    }
+
+    return parser_link(parser);
+}
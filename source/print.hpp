@@ -66,11 +66,39 @@ template<typename... Args>
     return (str){builder.data, builder.length};
 }
 
+namespace print_detail {
+
+/* Reused by fprint and sprint_arena, so formatting doesn't malloc every time.
+ * One per thread, so printing from several threads at once is safe. */
+inline thread_local Array<char> scratch_builder = {};
+
+template<typename... Args>
+str format_to_scratch(const char* format_str, Args&&... args) {
+    assert(print_detail::count_specifiers(format_str) == sizeof...(args) &&
+           "print: Mismatch between format specifiers (%) and arguments");
+    assert(format_str != NULL && "Don't pass NULL as format string!");
+
+    Array<char> *builder = &scratch_builder;
+    builder->length = 0;
+    print_detail::print_impl_recursive(builder, (char*)format_str, std::forward<Args>(args)...);
+    return (str){builder->data, builder->length};
+}
+
+} // namespace print_detail
+
+/*
+ * - Returns a `str` allocated in the arena, don't `str_free` it.
+ */
+template<typename... Args>
+[[nodiscard]] str sprint_arena(Arena *arena, const char* format_str, Args&&... args) {
+    str string = print_detail::format_to_scratch(format_str, std::forward<Args>(args)...);
+    return str_copy_arena(arena, string);
+}
+
 template<typename... Args>
 void fprint(FILE *stream, const char* format_str, Args&&... args) {
-    str string = sprint(format_str, std::forward<Args>(args)...);
+    str string = print_detail::format_to_scratch(format_str, std::forward<Args>(args)...);
     fwrite(string.data, sizeof(*string.data), string.length, stream);
-    str_free(string);
 }
 
 template<typename... Args>
@@ -82,6 +110,16 @@ inline void builder_add(Array<char> *array, str string) {
     array_add_range(array, string.data, string.length);
 }
 
+/*
+ * - Appends to `builder`, for producing bigger texts piece by piece.
+ */
+template<typename... Args>
+void builder_print(Array<char> *builder, const char* format_str, Args&&... args) {
+    assert(print_detail::count_specifiers(format_str) == sizeof...(args) &&
+           "print: Mismatch between format specifiers (%) and arguments");
+    print_detail::print_impl_recursive(builder, format_str, std::forward<Args>(args)...);
+}
+
 namespace print_detail {
 
 // The "extension point" for user-defined types. ADL will find this.
@@ -112,8 +150,8 @@ void h_format_arg(Array<char>* builder, const T& value) {
         }
     }
     else if constexpr (std::is_integral_v<DecayedT> || std::is_floating_point_v<DecayedT>) {
-        char *buffer = builder->data + builder->length;
         array_reserve_to_add(builder,                   32       );
+        char *buffer = builder->data + builder->length;
         auto [ptr, ec] = std::to_chars(buffer, buffer + 32, value);
         assert((ec == std::errc()) && "Internal formtting error");
         builder->length += ptr - buffer;
@@ -0,0 +1,204 @@
+#pragma once
+
+/*
+ * program.cpp - one step of the model as a straight list of operations.
+ *
+ * Values are the inputs set by the runtime, the states kept between steps
+ * (UnitDelays) and temporaries, each computed by exactly one op.
+ * An op is a linear combination evaluated left to right,
+ *     result = ((constant + value0 * scale0) + value1 * scale1) + ...
+ * with every product rounded on its own. A Gain is one term, a Sum is
+ * terms with scales of +1 and -1, so the lowering is exact, and the
+ * optimizer rewrites ops within the same form (see optimize.cpp).
+ * A scale of +1 or -1 means no multiplication at all.
+ *
+ * Every value is double or single precision. An op computes in the
+ * precision of its result, the operands are converted to it first and its
+ * scales and constant are numbers of that precision. Inputs are doubles.
+ *
+ * After the ops, `updates` copy values into the states, all at once.
+ * The runtime reads the Outports after that, so neither updates nor
+ * Outports refer to a state directly, they get a copy made before the updates.
+ */
+
+#include <algorithm>
+
+#include "types.h"
+#include "array.hpp"
+#include "graph.cpp"
+#include "schedule.cpp"
+
+typedef u32 Value;
+#define VALUE_NONE ((Value)-1)
+
+enum Value_Kind : u8 {
+    VALUE_INPUT,
+    VALUE_STATE,
+    VALUE_TEMP,
+};
+
+struct Term {
+    Value value;
+    f64 scale;
+};
+
+struct Op {
+    Value result;
+    u32 first_term;   // into Program::terms
+    u32 term_count;
+    bool has_constant;
+    f64 constant;
+};
+
+struct Update {
+    Value state;
+    Value source;
+};
+
+struct Ext_Port {
+    Symbol name;
+    u32 sid;
+    Value value;
+    bool is_input;
+};
+
+struct Program {
+    // Values, column-wise
+    Array<u8> value_kind;      // Value_Kind
+    Array<Symbol> value_name;  // name of the block it came from
+    Array<u32> value_sid;
+    Array<f64> value_initial;  // states only
+    Array<u8> value_precision; // Precision, never PRECISION_DEFAULT
+
+    Array<Op> ops;             // in execution order
+    Array<Term> terms;
+    Array<Update> updates;
+    Array<Ext_Port> ports;     // sorted by name
+};
+
+void program_free(Program *program) {
+    array_free(&program->value_kind);
+    array_free(&program->value_name);
+    array_free(&program->value_sid);
+    array_free(&program->value_initial);
+    array_free(&program->value_precision);
+    array_free(&program->ops);
+    array_free(&program->terms);
+    array_free(&program->updates);
+    array_free(&program->ports);
+}
+
+inline u32 program_value_count(Program *program) {
+    return (u32)program->value_kind.length;
+}
+
+inline Term *op_terms(Program *program, Op *op) {
+    return program->terms.data + op->first_term;
+}
+
+/* `number` rounded to the nearest one of `precision`. */
+inline f64 precision_round(Precision precision, f64 number) {
+    return precision == PRECISION_SINGLE? (f64)(f32)number : number;
+}
+
+Value program_add_value(Program *program, Value_Kind kind, Symbol name, u32 sid, Precision precision, f64 initial = 0) {
+    array_add(&program->value_kind, (u8)kind);
+    array_add(&program->value_name, name);
+    array_add(&program->value_sid, sid);
+    array_add(&program->value_initial, precision_round(precision, initial));
+    array_add(&program->value_precision, (u8)precision);
+    return program_value_count(program) - 1;
+}
+
+/* Lowers the scheduled graph, blocks without a precision of their own get `precision`. */
+void program_build(Program *program, Graph *graph, Schedule *schedule, Precision precision) {
+    Array<Value> output_value = {};  // by block
+    array_reserve(&output_value, graph->block_count);
+    output_value.length = graph->block_count;
+    for (u32 b = 0; b < graph->block_count; b++) output_value[b] = VALUE_NONE;
+
+    auto add_block_value = [&](u32 block, Value_Kind kind, f64 initial) {
+        Precision own = (Precision)graph->blocks.precision[block];
+        if (kind == VALUE_INPUT) own = PRECISION_DOUBLE;
+        if (own == PRECISION_DEFAULT) own = precision;
+        output_value[block] = program_add_value(program, kind, graph->blocks.name[block], graph->blocks.sid[block], own, initial);
+    };
+
+    // Inputs first, then in the order of computation, states last
+    for (u32 b = 0; b < graph->block_count; b++) {
+        if (graph_block_type(graph, b) == IN_PORT) add_block_value(b, VALUE_INPUT, 0);
+    }
+    for (u32 block : schedule->order) {
+        Block_Type type = graph_block_type(graph, block);
+        if (type == SUM || type == GAIN) add_block_value(block, VALUE_TEMP, 0);
+    }
+    for (u32 block : schedule->delays) {
+        add_block_value(block, VALUE_STATE, graph_params(graph, block)[0]);
+    }
+
+    auto operand = [&](u32 input_slot) { return output_value[graph_driver(graph, input_slot)]; };
+
+    for (u32 block : schedule->order) {
+        Block_Type type = graph_block_type(graph, block);
+        if (type != SUM && type != GAIN) continue;
+
+        Op op = {output_value[block], (u32)program->terms.length, 0, false, 0};
+        f64 *params = graph_params(graph, block);
+        Precision op_precision = (Precision)program->value_precision[op.result];
+        u32 first_input = graph->input_offsets[block];
+        op.term_count = graph_input_count(graph, block);
+        for (u32 i = 0; i < op.term_count; i++) {
+            array_add(&program->terms, (Term){operand(first_input + i), precision_round(op_precision, params[i])});
+        }
+        if (op.term_count == 0) op.has_constant = true;  // an empty Sum
+        array_add(&program->ops, op);
+    }
+
+    // Updates happen at once and ports are read after them, so both need
+    // the old value of a state: one copy of it is made before the updates
+    Array<Value> snapshot = {};  // by value
+    array_reserve(&snapshot, program_value_count(program));
+    snapshot.length = program_value_count(program);
+    for (Value v = 0; v < snapshot.length; v++) snapshot[v] = VALUE_NONE;
+    auto after_step = [&](Value value, u32 block) {
+        if (program->value_kind[value] != VALUE_STATE) return value;
+        if (snapshot[value] == VALUE_NONE) {
+            Value copy = program_add_value(program, VALUE_TEMP, graph->blocks.name[block], graph->blocks.sid[block],
+                                           (Precision)program->value_precision[value]);
+            array_add(&program->ops, (Op){copy, (u32)program->terms.length, 1, false, 0});
+            array_add(&program->terms, (Term){value, 1.0});
+            snapshot[value] = copy;
+        }
+        return snapshot[value];
+    };
+
+    for (u32 block : schedule->delays) {
+        Value source = after_step(operand(graph->input_offsets[block]), block);
+        array_add(&program->updates, (Update){output_value[block], source});
+    }
+
+    for (u32 b = 0; b < graph->block_count; b++) {
+        Block_Type type = graph_block_type(graph, b);
+        if (type == IN_PORT) {
+            array_add(&program->ports, (Ext_Port){graph->blocks.name[b], graph->blocks.sid[b], output_value[b], true});
+        } else if (type == OUT_PORT) {
+            Value value = after_step(operand(graph->input_offsets[b]), b);
+            array_add(&program->ports, (Ext_Port){graph->blocks.name[b], graph->blocks.sid[b], value, false});
+        }
+    }
+    array_free(&output_value);
+    array_free(&snapshot);
+}
+
+/* Orders the ports by name for the runtime's lookup, byte by byte like strcmp,
+ * and by SID for equal names. str_compare won't do, it puts shorter names first. */
+void program_sort_ports(Program *program, Intern_Table *symbols) {
+    std::sort(program->ports.data, program->ports.data + program->ports.length, [&](Ext_Port &a, Ext_Port &b) {
+        str a_name = symbol_str(symbols, a.name);
+        str b_name = symbol_str(symbols, b.name);
+        u64 common = a_name.length < b_name.length? a_name.length : b_name.length;
+        int order = common == 0? 0 : memcmp(a_name.data, b_name.data, common);
+        if (order == 0) order = (a_name.length > b_name.length) - (a_name.length < b_name.length);
+        return order != 0? order < 0 : a.sid < b.sid;
+    });
+}
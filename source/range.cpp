@@ -0,0 +1,172 @@
+#pragma once
+
+/*
+ * range.cpp - the range of every value of the step program, and its fixed-point format.
+ *
+ * Intervals go through the ops like the values do: a product with a constant
+ * scales the interval, a sum adds the ends. The inputs have to be given a
+ * range, the states can be: a state without one starts at its initial value
+ * and takes in its update's range until nothing changes anymore. To get
+ * there in a few rounds a growing state is widened to a power of two
+ * symmetric around zero, so a state that keeps doubling is a feedback loop
+ * with a gain of at least one and has no range, that's an error.
+ *
+ * A value is stored in an int32 with `frac_bits` bits after the point, as
+ * many as its range leaves, its magnitude stays below 2^(31 - frac_bits).
+ * Ranges are bounds on the exact values, a value rounded past its range
+ * saturates (see codegen_fixed.cpp).
+ */
+
+#include <math.h>
+#include <algorithm>
+
+#include "types.h"
+#include "array.hpp"
+#include "program.cpp"
+
+// Integer bits of the widest value, the others need headroom in the int64 accumulators
+#define RANGE_MAX_EXPONENT 31
+// Finer than that every value is 0 anyway
+#define RANGE_MAX_FRAC_BITS 62
+
+struct Range {
+    f64 lo;
+    f64 hi;
+};
+
+/* A range asked for on the command line, for an Inport or a UnitDelay. */
+struct Range_Bound {
+    str name;
+    Range range;
+};
+
+struct Fixed_Formats {
+    Array<Range> range;    // by value
+    Array<s32> frac_bits;  // by value
+};
+
+void fixed_formats_free(Fixed_Formats *formats) {
+    array_free(&formats->range);
+    array_free(&formats->frac_bits);
+}
+
+inline f64 range_magnitude(Range range) {
+    return fmax(fabs(range.lo), fabs(range.hi));
+}
+
+/* The exponent `e` with magnitude < 2^e, the smallest for 0 too. */
+inline s32 range_exponent(f64 magnitude) {
+    if (magnitude == 0) return -RANGE_MAX_FRAC_BITS;
+    int exponent;
+    frexp(magnitude, &exponent);
+    return exponent;
+}
+
+namespace range_detail {
+
+static Range op_range(Program *program, Array<Range> *range, Op *op) {
+    Range result = {0, 0};
+    if (op->has_constant) result = {op->constant, op->constant};
+    Term *terms = op_terms(program, op);
+    for (u32 t = 0; t < op->term_count; t++) {
+        Range value = (*range)[terms[t].value];
+        f64 k = terms[t].scale;
+        Range product = k >= 0? (Range){value.lo * k, value.hi * k} : (Range){value.hi * k, value.lo * k};
+        if (k == 0) product = {0, 0};  // 0 * inf
+        result.lo += product.lo;
+        result.hi += product.hi;
+    }
+    return result;
+}
+
+/* [-2^e, 2^e] covering `range`. */
+static Range widen(Range range) {
+    f64 bound = ldexp(1.0, range_exponent(range_magnitude(range)));
+    return {-bound, bound};
+}
+
+} // namespace range_detail
+
+Parsed range_analyze(Fixed_Formats *formats, Program *program, Intern_Table *symbols, Array<Range_Bound> *bounds) {
+    using namespace range_detail;
+
+    u32 value_count = program_value_count(program);
+    Array<u8> bounded = {};  // by value, given on the command line
+    array_reserve(&formats->range, value_count);
+    array_reserve(&bounded, value_count);
+    for (Value v = 0; v < value_count; v++) {
+        f64 initial = program->value_initial[v];
+        array_add(&formats->range, (Range){initial, initial});
+        array_add(&bounded, (u8)0);
+    }
+
+    Parsed result = GOOD;
+    for (Range_Bound &bound : *bounds) {
+        bool found = false;
+        for (Value v = 0; v < value_count; v++) {
+            if (program->value_kind[v] == VALUE_TEMP || !(symbol_str(symbols, program->value_name[v]) == bound.name)) continue;
+            formats->range[v] = bound.range;
+            bounded[v] = 1;
+            found = true;
+        }
+        if (!found) {
+            report_error("there is no Inport or UnitDelay named % to give a range", bound.name);
+            result = ERROR;
+        }
+    }
+    for (Ext_Port &port : program->ports) {
+        if (!port.is_input || bounded[port.value]) continue;
+        report_error("Inport % needs a range for fixed point, give it one with --range", symbol_str(symbols, port.name));
+        result = ERROR;
+    }
+    for (Term &term : program->terms) {
+        if (isfinite(term.scale)) continue;
+        report_error("fixed point needs finite gains, not %", term.scale);
+        result = ERROR;
+        break;
+    }
+    for (Op &op : program->ops) {
+        if (op.has_constant && !isfinite(op.constant)) {
+            report_error("fixed point needs finite constants, not %", op.constant);
+            result = ERROR;
+            break;
+        }
+    }
+
+    // Until the states settle, each round is a step from every state at once
+    f64 limit = ldexp(1.0, RANGE_MAX_EXPONENT);
+    bool changed = result == GOOD;
+    while (changed) {
+        changed = false;
+        for (Op &op : program->ops) formats->range[op.result] = op_range(program, &formats->range, &op);
+        for (Update &update : program->updates) {
+            if (bounded[update.state]) continue;
+            Range *state = &formats->range[update.state];
+            Range source = formats->range[update.source];
+            if (source.lo >= state->lo && source.hi <= state->hi) continue;
+
+            *state = widen((Range){fmin(state->lo, source.lo), fmax(state->hi, source.hi)});
+            changed = true;
+            if (range_magnitude(*state) > limit) {
+                report_error("the range of UnitDelay % doesn't settle, give it one with --range",
+                             symbol_str(symbols, program->value_name[update.state]));
+                result = ERROR;
+            }
+        }
+        if (result != GOOD) break;
+    }
+
+    array_reserve(&formats->frac_bits, value_count);
+    for (Value v = 0; v < value_count && result == GOOD; v++) {
+        Range range = formats->range[v];
+        s32 exponent = range_exponent(range_magnitude(range));
+        if (exponent > RANGE_MAX_EXPONENT) {
+            report_error("% goes up to %, too much for 32 bits", symbol_str(symbols, program->value_name[v]), range_magnitude(range));
+            result = ERROR;
+        }
+        array_add(&formats->frac_bits, std::min(31 - exponent, (s32)RANGE_MAX_FRAC_BITS));
+    }
+
+    array_free(&bounded);
+    return result;
+}
@@ -0,0 +1,499 @@
+#pragma once
+
+/*
+ * scc.cpp - strongly connected components of the dependency graph, the algebraic loops.
+ *
+ * Only the edges that order the computation count (see graph_is_dependency),
+ * so a cycle here is one that no UnitDelay breaks.
+ *
+ * First everything that can't be on a cycle is trimmed in linear time:
+ * blocks with no dependency left in front or behind them, repeatedly.
+ * The rest falls apart into weakly connected pieces, which are independent
+ * tasks for the worker threads, small ones are packed together.
+ *
+ * A task is a set of blocks tagged with a color, every block carries the
+ * color of the task it's in and a search never leaves its color, so tasks
+ * need no locking. A big task is split by forward-backward decomposition:
+ * the blocks both reachable from a pivot and reaching it form its component,
+ * the ones reached only forward, only backward or not at all are three new
+ * tasks. That stops paying off once a split peels off next to nothing
+ * (a big piece full of small components), then and for small tasks it's
+ * Tarjan's algorithm on one thread, which is linear.
+ *
+ * SEE: Fleischer, Hendrickson, Pinar - On Identifying Strongly Connected Components in Parallel
+ * SEE: Hong, Rodia, Olukotun - On Fast Parallel Detection of Strongly Connected Components (trimming, WCC)
+ */
+
+#include <mutex>
+#include <thread>
+#include <condition_variable>
+#include <algorithm>
+
+#include "types.h"
+#include "array.hpp"
+#include "graph.cpp"
+
+/* Components as CSR: the blocks of component c are blocks[offsets[c] .. offsets[c + 1]) */
+struct Scc_Loops {
+    Array<u32> blocks;
+    Array<u32> offsets;
+};
+
+void scc_loops_free(Scc_Loops *loops) {
+    array_free(&loops->blocks);
+    array_free(&loops->offsets);
+}
+
+inline u32 scc_loop_count(Scc_Loops *loops) {
+    return loops->offsets.length == 0? 0 : (u32)loops->offsets.length - 1;
+}
+
+namespace scc_detail {
+
+// Smaller tasks are left to Tarjan's algorithm and stay with the thread that made them
+#define SCC_SPLIT_MIN_BLOCKS 4096
+
+#define SCC_COLOR_DONE 0
+#define SCC_UNVISITED ((u32)-1)
+
+enum : u8 {
+    REACHED_FORWARD  = 1,
+    REACHED_BACKWARD = 2,
+    ON_STACK         = 4,
+};
+
+struct Task {
+    u32 color;
+    bool sequential;  // splitting won't help, use Tarjan's algorithm
+    Array<u32> blocks;
+};
+
+/* Per-block arrays are written only by the thread owning the block's task. */
+struct Pool {
+    Graph *graph;
+    u32 *color;
+    u8 *flags;
+    u32 *index;    // Tarjan's visit order and lowlink
+    u32 *lowlink;
+    u32 next_color;
+
+    std::mutex lock;
+    std::condition_variable wake;
+    Array<Task> shared;       // guarded by lock
+    u32 busy;                 // guarded by lock, workers in the middle of a task
+    Array<u32> found;         // guarded by lock, components back to back
+    Array<u32> found_offsets;
+};
+
+/* Scratch of one worker */
+struct Worker {
+    Array<Task> local;
+    Array<u32> queue;
+    Array<u32> stack;
+    Array<u32> frames;  // Tarjan's call stack: block, then input slot to look at next
+    Array<u32> found;
+    Array<u32> found_lengths;
+};
+
+inline u32 load_color(Pool *pool, u32 block) {
+    return __atomic_load_n(&pool->color[block], __ATOMIC_RELAXED);
+}
+
+inline void store_color(Pool *pool, u32 block, u32 color) {
+    __atomic_store_n(&pool->color[block], color, __ATOMIC_RELAXED);
+}
+
+inline u32 new_color(Pool *pool) {
+    return __atomic_fetch_add(&pool->next_color, 1, __ATOMIC_RELAXED);
+}
+
+/* Calls `visit(next)` for every block `block` has a dependency edge to, in the given direction. */
+template<typename Visit>
+inline void for_each_dependency(Graph *graph, u32 block, bool forward, Visit visit) {
+    if (forward) {
+        for (u32 o = graph->output_offsets[block]; o < graph->output_offsets[block + 1]; o++) {
+            u32 signal = graph->output_signal[o];
+            if (signal == GRAPH_NONE) continue;
+            for (u32 f = graph->fanout_offsets[signal]; f < graph->fanout_offsets[signal + 1]; f++) {
+                u32 input = graph->fanout_inputs[f];
+                u32 consumer = graph->input_block[input];
+                if (graph_is_dependency(graph, consumer, input)) visit(consumer);
+            }
+        }
+    } else {
+        for (u32 i = graph->input_offsets[block]; i < graph->input_offsets[block + 1]; i++) {
+            if (graph_is_dependency(graph, block, i)) visit(graph_driver(graph, i));
+        }
+    }
+}
+
+/* Drops blocks of the scope that have no in-scope dependency in front of them (or behind, if !forward),
+ * and then the ones that had only those, and so on. */
+static void trim(Graph *graph, Array<u8> *in_scope, bool forward) {
+    Array<u32> degree = {};
+    Array<u32> queue = {};
+    array_reserve(&degree, graph->block_count);
+    for (u32 b = 0; b < graph->block_count; b++) {
+        u32 count = 0;
+        if ((*in_scope)[b]) {
+            for_each_dependency(graph, b, !forward, [&](u32 other) { count += (*in_scope)[other]; });
+            if (count == 0) array_add(&queue, b);
+        }
+        array_add(&degree, count);
+    }
+
+    for (u64 head = 0; head < queue.length; head++) {
+        u32 block = queue[head];
+        (*in_scope)[block] = 0;
+        for_each_dependency(graph, block, forward, [&](u32 next) {
+            if ((*in_scope)[next] && --degree[next] == 0) array_add(&queue, next);
+        });
+    }
+
+    array_free(&degree);
+    array_free(&queue);
+}
+
+static u32 find_root(Array<u32> *parent, u32 block) {
+    while ((*parent)[block] != block) {
+        (*parent)[block] = (*parent)[(*parent)[block]];  // path halving
+        block = (*parent)[block];
+    }
+    return block;
+}
+
+/* Weakly connected pieces of the scope as tasks, the small ones packed together. */
+static void make_tasks(Pool *pool, Array<u8> *in_scope) {
+    Graph *graph = pool->graph;
+    Array<u32> parent = {};
+    array_reserve(&parent, graph->block_count);
+    for (u32 b = 0; b < graph->block_count; b++) array_add(&parent, b);
+
+    for (u32 b = 0; b < graph->block_count; b++) {
+        if (!(*in_scope)[b]) continue;
+        for_each_dependency(graph, b, /*forward*/false, [&](u32 driver) {
+            if (!(*in_scope)[driver]) return;
+            u32 x = find_root(&parent, b);
+            u32 y = find_root(&parent, driver);
+            if (x != y) parent[std::max(x, y)] = std::min(x, y);
+        });
+    }
+    for (u32 b = 0; b < graph->block_count; b++) parent[b] = find_root(&parent, b);
+
+    // Blocks grouped by piece with a counting sort, pieces ordered by their root
+    Array<u32> offsets = {};
+    array_reserve(&offsets, graph->block_count + 1);
+    offsets.length = graph->block_count + 1;
+    for (u32 b = 0; b <= graph->block_count; b++) offsets[b] = 0;
+    for (u32 b = 0; b < graph->block_count; b++) {
+        if ((*in_scope)[b]) offsets[parent[b] + 1]++;
+    }
+    for (u32 b = 0; b < graph->block_count; b++) offsets[b + 1] += offsets[b];
+    Array<u32> grouped = {};
+    array_reserve(&grouped, offsets[graph->block_count]);
+    grouped.length = offsets[graph->block_count];
+    for (u32 b = 0; b < graph->block_count; b++) {
+        if ((*in_scope)[b]) grouped[offsets[parent[b]]++] = b;
+    }
+
+    // `offsets[root]` now points at the end of the piece
+    Task batch = {new_color(pool), true, {}};
+    u32 start = 0;
+    for (u32 root = 0; root < graph->block_count; root++) {
+        u32 end = offsets[root];
+        if (end == start) continue;
+        bool big = end - start >= SCC_SPLIT_MIN_BLOCKS;
+        Task piece = {new_color(pool), false, {}};
+        Task *task = big? &piece : &batch;
+        for (u32 i = start; i < end; i++) {
+            store_color(pool, grouped[i], task->color);
+            array_add(&task->blocks, grouped[i]);
+        }
+        if (big) array_add(&pool->shared, piece);
+        if (batch.blocks.length >= SCC_SPLIT_MIN_BLOCKS) {
+            array_add(&pool->shared, batch);
+            batch = (Task){new_color(pool), true, {}};
+        }
+        start = end;
+    }
+    if (batch.blocks.length != 0) array_add(&pool->shared, batch);
+
+    array_free(&parent);
+    array_free(&offsets);
+    array_free(&grouped);
+}
+
+static bool has_self_loop(Graph *graph, u32 block) {
+    bool found = false;
+    for_each_dependency(graph, block, false, [&](u32 driver) { found |= driver == block; });
+    return found;
+}
+
+static void add_component(Pool *pool, Worker *worker, u32 *blocks, u32 length) {
+    if (length == 1 && !has_self_loop(pool->graph, blocks[0])) return;
+    array_add_range(&worker->found, blocks, length);
+    array_add(&worker->found_lengths, length);
+}
+
+/* Moves the components found by the worker over to the pool. */
+static void flush_found(Pool *pool, Worker *worker) {
+    if (worker->found_lengths.length == 0) return;
+    std::lock_guard<std::mutex> guard(pool->lock);
+    array_add_range(&pool->found, worker->found.data, worker->found.length);
+    for (u32 length : worker->found_lengths) {
+        array_add(&pool->found_offsets, pool->found_offsets[pool->found_offsets.length - 1] + length);
+    }
+    worker->found.length = 0;
+    worker->found_lengths.length = 0;
+}
+
+/* Iterative Tarjan over the reversed edges, the components are the same. */
+static void tarjan(Pool *pool, Worker *worker, Task *task) {
+    Graph *graph = pool->graph;
+    for (u32 block : task->blocks) pool->index[block] = SCC_UNVISITED;
+
+    u32 counter = 0;
+    auto visit = [&](u32 block) {
+        pool->index[block] = pool->lowlink[block] = counter++;
+        pool->flags[block] |= ON_STACK;
+        array_add(&worker->stack, block);
+        array_add(&worker->frames, block);
+        array_add(&worker->frames, graph->input_offsets[block]);
+    };
+
+    for (u32 root : task->blocks) {
+        if (pool->index[root] != SCC_UNVISITED) continue;
+        visit(root);
+        while (worker->frames.length != 0) {
+            u32 block = worker->frames[worker->frames.length - 2];
+            u32 input = worker->frames[worker->frames.length - 1];
+
+            if (input < graph->input_offsets[block + 1]) {
+                worker->frames[worker->frames.length - 1]++;
+                if (!graph_is_dependency(graph, block, input)) continue;
+                u32 driver = graph_driver(graph, input);
+                if (load_color(pool, driver) != task->color) continue;
+                if (pool->index[driver] == SCC_UNVISITED) {
+                    visit(driver);
+                } else if (pool->flags[driver] & ON_STACK) {
+                    pool->lowlink[block] = std::min(pool->lowlink[block], pool->index[driver]);
+                }
+                continue;
+            }
+
+            worker->frames.length -= 2;
+            if (worker->frames.length != 0) {
+                u32 caller = worker->frames[worker->frames.length - 2];
+                pool->lowlink[caller] = std::min(pool->lowlink[caller], pool->lowlink[block]);
+            }
+            if (pool->lowlink[block] != pool->index[block]) continue;
+
+            u64 top = worker->stack.length;
+            u64 bottom = top;
+            do {
+                bottom--;
+                pool->flags[worker->stack[bottom]] &= ~ON_STACK;
+            } while (worker->stack[bottom] != block);
+            add_component(pool, worker, worker->stack.data + bottom, (u32)(top - bottom));
+            worker->stack.length = bottom;
+        }
+    }
+
+    for (u32 block : task->blocks) store_color(pool, block, SCC_COLOR_DONE);
+}
+
+static void reach(Pool *pool, Worker *worker, u32 color, u32 pivot, bool forward) {
+    u8 bit = forward? REACHED_FORWARD : REACHED_BACKWARD;
+    Array<u32> *queue = &worker->queue;
+    queue->length = 0;
+    pool->flags[pivot] |= bit;
+    array_add(queue, pivot);
+    for (u64 head = 0; head < queue->length; head++) {
+        for_each_dependency(pool->graph, (*queue)[head], forward, [&](u32 next) {
+            // The color is checked first, blocks of other colors belong to other threads
+            if (load_color(pool, next) == color && !(pool->flags[next] & bit)) {
+                pool->flags[next] |= bit;
+                array_add(queue, next);
+            }
+        });
+    }
+}
+
+static void share(Pool *pool, Task task) {
+    {
+        std::lock_guard<std::mutex> guard(pool->lock);
+        array_add(&pool->shared, task);
+    }
+    pool->wake.notify_one();
+}
+
+/* Splits off the component of the first block, the rest goes back to the worker or the pool. */
+static void split(Pool *pool, Worker *worker, Task *task) {
+    u32 pivot = task->blocks[0];
+    reach(pool, worker, task->color, pivot, /*forward*/true);
+    reach(pool, worker, task->color, pivot, /*forward*/false);
+
+    Task parts[3] = {};  // only forward, only backward, neither
+    for (Task &part : parts) part.color = new_color(pool);
+
+    Array<u32> *component = &worker->queue;
+    component->length = 0;
+    for (u32 block : task->blocks) {
+        u8 reached = pool->flags[block];
+        pool->flags[block] = 0;
+        Task *part = NULL;
+        switch (reached) {
+        case REACHED_FORWARD | REACHED_BACKWARD:
+            store_color(pool, block, SCC_COLOR_DONE);
+            array_add(component, block);
+            continue;
+        case REACHED_FORWARD:  part = &parts[0]; break;
+        case REACHED_BACKWARD: part = &parts[1]; break;
+        default:               part = &parts[2]; break;
+        }
+        store_color(pool, block, part->color);
+        array_add(&part->blocks, block);
+    }
+    add_component(pool, worker, component->data, (u32)component->length);
+
+    for (Task &part : parts) {
+        if (part.blocks.length == 0) continue;
+        // Another split would cost as much as this one and achieve as little
+        part.sequential = part.blocks.length > task->blocks.length - task->blocks.length / 16;
+        if (part.blocks.length >= SCC_SPLIT_MIN_BLOCKS) share(pool, part);
+        else array_add(&worker->local, part);
+    }
+}
+
+static void work(Pool *pool) {
+    Worker worker = {};
+
+    std::unique_lock<std::mutex> guard(pool->lock);
+    while (1) {
+        pool->wake.wait(guard, [&] { return pool->shared.length != 0 || pool->busy == 0; });
+        if (pool->shared.length == 0) break;  // nobody is working, so nothing new will come
+
+        Task task = pool->shared[pool->shared.length - 1];
+        pool->shared.length--;
+        pool->busy++;
+        guard.unlock();
+
+        array_add(&worker.local, task);
+        while (worker.local.length != 0) {
+            Task next = worker.local[worker.local.length - 1];
+            worker.local.length--;
+            if (next.sequential || next.blocks.length < SCC_SPLIT_MIN_BLOCKS) tarjan(pool, &worker, &next);
+            else split(pool, &worker, &next);
+            array_free(&next.blocks);
+        }
+        flush_found(pool, &worker);
+
+        guard.lock();
+        pool->busy--;
+        if (pool->busy == 0 && pool->shared.length == 0) pool->wake.notify_all();
+    }
+    guard.unlock();
+
+    array_free(&worker.local);
+    array_free(&worker.queue);
+    array_free(&worker.stack);
+    array_free(&worker.frames);
+    array_free(&worker.found);
+    array_free(&worker.found_lengths);
+}
+
+} // namespace scc_detail
+
+/* Finds the components among the `in_scope` blocks that are cycles, `in_scope` is consumed.
+ * Blocks and components come out ordered by block index, whatever the thread timing. */
+void scc_find_loops(Scc_Loops *loops, Graph *graph, Array<u8> *in_scope, u32 thread_count = 0) {
+    using namespace scc_detail;
+
+    trim(graph, in_scope, /*forward*/true);
+    trim(graph, in_scope, /*forward*/false);
+
+    Array<u32> color = {};
+    Array<u8> flags = {};
+    Array<u32> index = {};
+    Array<u32> lowlink = {};
+    array_reserve(&color, graph->block_count);
+    array_reserve(&flags, graph->block_count);
+    array_reserve(&index, graph->block_count);
+    array_reserve(&lowlink, graph->block_count);
+    u32 candidates = 0;
+    for (u32 b = 0; b < graph->block_count; b++) {
+        array_add(&color, (u32)SCC_COLOR_DONE);
+        array_add(&flags, (u8)0);
+        array_add(&index, SCC_UNVISITED);
+        array_add(&lowlink, SCC_UNVISITED);
+        candidates += (*in_scope)[b];
+    }
+
+    Pool pool = {};
+    pool.graph = graph;
+    pool.color = color.data;
+    pool.flags = flags.data;
+    pool.index = index.data;
+    pool.lowlink = lowlink.data;
+    pool.next_color = SCC_COLOR_DONE + 1;
+    array_add(&pool.found_offsets, 0u);
+
+    if (candidates != 0) {
+        make_tasks(&pool, in_scope);
+        if (thread_count == 0) thread_count = std::max(1u, std::thread::hardware_concurrency());
+        thread_count = (u32)std::min<u64>(thread_count, candidates / SCC_SPLIT_MIN_BLOCKS + 1);
+
+        Array<std::thread *> threads = {};
+        for (u32 t = 1; t < thread_count; t++) array_add(&threads, new std::thread(work, &pool));
+        work(&pool);
+        for (std::thread *thread : threads) {
+            thread->join();
+            delete thread;
+        }
+        array_free(&threads);
+    }
+
+    // Components were found in whatever order the threads got to them
+    u32 count = (u32)pool.found_offsets.length - 1;
+    Array<u32> by_first = {};
+    for (u32 c = 0; c < count; c++) {
+        std::sort(pool.found.data + pool.found_offsets[c], pool.found.data + pool.found_offsets[c + 1]);
+        array_add(&by_first, c);
+    }
+    std::sort(by_first.data, by_first.data + by_first.length, [&](u32 a, u32 b) {
+        return pool.found[pool.found_offsets[a]] < pool.found[pool.found_offsets[b]];
+    });
+
+    array_add(&loops->offsets, (u32)loops->blocks.length);
+    for (u32 c : by_first) {
+        array_add_range(&loops->blocks, pool.found.data + pool.found_offsets[c],
+                        pool.found_offsets[c + 1] - pool.found_offsets[c]);
+        array_add(&loops->offsets, (u32)loops->blocks.length);
+    }
+
+    array_free(&by_first);
+    array_free(&pool.shared);
+    array_free(&pool.found);
+    array_free(&pool.found_offsets);
+    array_free(&color);
+    array_free(&flags);
+    array_free(&index);
+    array_free(&lowlink);
+}
+
+/* Reports every algebraic loop among the `suspect` blocks (consumed) with the names and SIDs. */
+void report_algebraic_loops(Graph *graph, Intern_Table *symbols, Array<u8> *suspect) {
+    Scc_Loops loops = {};
+    scc_find_loops(&loops, graph, suspect);
+
+    for (u32 c = 0; c < scc_loop_count(&loops); c++) {
+        report_error("algebraic loop, no UnitDelay breaks the cycle through % blocks:",
+                     loops.offsets[c + 1] - loops.offsets[c]);
+        for (u32 i = loops.offsets[c]; i < loops.offsets[c + 1]; i++) {
+            u32 block = loops.blocks[i];
+            fprint(stderr, "    % (SID %)\n", symbol_str(symbols, graph->blocks.name[block]), graph->blocks.sid[block]);
+        }
+    }
+
+    scc_loops_free(&loops);
+}
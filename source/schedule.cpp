@@ -0,0 +1,87 @@
+#pragma once
+
+/*
+ * schedule.cpp - order of block computations in one step.
+ *
+ * Every block is computed after the blocks driving its inputs.
+ * A UnitDelay breaks that: its output is the state from the previous step,
+ * so it is ready at the start of the step (a source), and its input is only
+ * needed to update the state at the end of the step (a sink).
+ *
+ * Kahn's algorithm over the CSR graph with an explicit queue: O(V + E),
+ * no recursion, so the depth of the model doesn't matter.
+ * Whatever is left unscheduled is behind a cycle without a delay,
+ * an algebraic loop, those are found and reported by scc.cpp.
+ */
+
+#include "types.h"
+#include "array.hpp"
+#include "graph.cpp"
+#include "scc.cpp"
+
+struct Schedule {
+    Array<u32> order;   // every block except delays, each after its inputs
+    Array<u32> delays;  // state updates, done after `order`
+};
+
+void schedule_free(Schedule *schedule) {
+    array_free(&schedule->order);
+    array_free(&schedule->delays);
+}
+
+/* The outputs of `block` are computed, queues the consumers that have nothing left to wait for. */
+static void release_outputs(Schedule *schedule, Graph *graph, Array<u32> *pending, u32 block) {
+    for (u32 o = graph->output_offsets[block]; o < graph->output_offsets[block + 1]; o++) {
+        u32 signal = graph->output_signal[o];
+        if (signal == GRAPH_NONE) continue;
+        for (u32 f = graph->fanout_offsets[signal]; f < graph->fanout_offsets[signal + 1]; f++) {
+            u32 input = graph->fanout_inputs[f];
+            u32 consumer = graph->input_block[input];
+            if (!graph_is_dependency(graph, consumer, input)) continue;
+            if (--(*pending)[consumer] == 0) array_add(&schedule->order, consumer);
+        }
+    }
+}
+
+Parsed schedule_build(Schedule *schedule, Graph *graph, Intern_Table *symbols) {
+    u32 block_count = graph->block_count;
+
+    // Number of inputs of each block that still wait for their driver
+    Array<u32> pending = {};
+    array_reserve(&pending, block_count);
+    for (u32 b = 0; b < block_count; b++) {
+        u32 count = 0;
+        for (u32 i = graph->input_offsets[b]; i < graph->input_offsets[b + 1]; i++) {
+            count += graph_is_dependency(graph, b, i);
+        }
+        array_add(&pending, count);
+    }
+
+    // `order` doubles as the FIFO queue: [head, length) are ready but not expanded
+    array_reserve(&schedule->order, block_count);
+    for (u32 b = 0; b < block_count; b++) {
+        if (graph_block_type(graph, b) == DELAY) {
+            array_add(&schedule->delays, b);
+        } else if (pending[b] == 0) {
+            array_add(&schedule->order, b);
+        }
+    }
+
+    for (u64 head = 0; head < schedule->order.length; head++) {
+        release_outputs(schedule, graph, &pending, schedule->order[head]);
+    }
+
+    Parsed result = GOOD;
+    if (schedule->order.length + schedule->delays.length != block_count) {
+        // Only what is still pending can be on a loop
+        Array<u8> suspect = {};
+        array_reserve(&suspect, block_count);
+        for (u32 b = 0; b < block_count; b++) array_add(&suspect, (u8)(pending[b] != 0));
+        report_algebraic_loops(graph, symbols, &suspect);
+        array_free(&suspect);
+        result = ERROR;
+    }
+
+    array_free(&pending);
+    return result;
+}
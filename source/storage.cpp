@@ -0,0 +1,170 @@
+#pragma once
+
+/*
+ * storage.cpp - where each value of the step program lives.
+ *
+ * Only what outlives a step goes into the persistent struct: the inputs set
+ * by the runtime, the states, and the values Outports show, the runtime
+ * reads those after the step. So do values nothing reads, those are only
+ * left unoptimized. Everything else is a temporary of the step.
+ *
+ * A temporary read by a single op is computed right inside that op's
+ * expression, so chains of blocks become one nested C expression with
+ * nothing stored in between. The nesting is bounded by `max_depth`.
+ * Values read by the updates aren't inlined, the updates happen all at once
+ * and an expression there could read a state that was just updated.
+ *
+ * The other temporaries get a local slot. One lives from the op computing
+ * it to its last reader, an op or the updates at the end, where reading an
+ * inlined value means reading what it reads. Those intervals are colored
+ * greedily in execution order, a slot is free again after its value's last
+ * read, which needs as many slots as the most temporaries alive at once.
+ * An op may read and write the same slot, `t0 = t0 * 2` reads before it writes.
+ * Doubles and singles have separate slots, so every slot has one C type.
+ */
+
+#include <algorithm>
+
+#include "types.h"
+#include "array.hpp"
+#include "program.cpp"
+
+// C compilers only have to support 63 levels of nested parentheses
+#define STORAGE_MAX_DEPTH 63
+
+enum Storage_Class : u8 {
+    STORAGE_STATIC,  // a member of the persistent struct
+    STORAGE_LOCAL,   // a slot in the step
+    STORAGE_INLINE,  // computed inside its only reader
+    STORAGE_NONE,    // not computed anymore
+};
+
+struct Storage {
+    Array<u8> storage_class;  // by value, Storage_Class
+    Array<u32> slot;          // by value, locals only
+    Array<u32> def;           // by value, the op computing it
+    Array<u8> slot_precision; // by slot, Precision
+    u32 slot_count;
+};
+
+void storage_free(Storage *storage) {
+    array_free(&storage->storage_class);
+    array_free(&storage->slot);
+    array_free(&storage->def);
+    array_free(&storage->slot_precision);
+}
+
+namespace storage_detail {
+
+/* Calls `read` with every value op `op_index` reads, looking through inlined values. */
+template <typename Fn>
+static void for_each_read(Storage *storage, Program *program, u32 op_index, Fn read) {
+    Op *op = &program->ops[op_index];
+    Term *terms = op_terms(program, op);
+    for (u32 t = 0; t < op->term_count; t++) {
+        Value value = terms[t].value;
+        if (storage->storage_class[value] == STORAGE_INLINE) {
+            for_each_read(storage, program, storage->def[value], read);
+        } else {
+            read(value);
+        }
+    }
+}
+
+} // namespace storage_detail
+
+/* `max_depth` is the most ops in one expression, 1 inlines nothing. */
+void storage_allocate(Storage *storage, Program *program, u32 max_depth) {
+    using namespace storage_detail;
+
+    u32 value_count = program_value_count(program);
+    u32 op_count = (u32)program->ops.length;
+    u32 updates_index = op_count;  // the updates read after every op
+
+    array_reserve(&storage->storage_class, value_count);
+    array_reserve(&storage->slot, value_count);
+    array_reserve(&storage->def, value_count);
+    for (Value v = 0; v < value_count; v++) {
+        array_add(&storage->storage_class, (u8)(program->value_kind[v] == VALUE_INPUT? STORAGE_STATIC : STORAGE_NONE));
+        array_add(&storage->slot, (u32)-1);
+        array_add(&storage->def, (u32)-1);
+    }
+    // Temporaries of removed ops and states without an update don't exist anymore
+    for (u32 i = 0; i < op_count; i++) {
+        storage->storage_class[program->ops[i].result] = STORAGE_LOCAL;
+        storage->def[program->ops[i].result] = i;
+    }
+    for (Update &update : program->updates) storage->storage_class[update.state] = STORAGE_STATIC;
+    for (Ext_Port &port : program->ports) storage->storage_class[port.value] = STORAGE_STATIC;
+
+    // Inline the temporaries with one reader, producers come first so their depth is known
+    Array<u32> uses = {};   // by value, number of op terms reading it
+    Array<u32> depth = {};  // by value, of the expression computing it
+    array_reserve(&uses, value_count);
+    array_reserve(&depth, value_count);
+    for (Value v = 0; v < value_count; v++) {
+        array_add(&uses, 0u);
+        array_add(&depth, 1u);
+    }
+    for (Op &op : program->ops) {
+        for (u32 t = 0; t < op.term_count; t++) uses[op_terms(program, &op)[t].value]++;
+    }
+    for (Update &update : program->updates) uses[update.source] = (u32)-1;  // never inlined
+    // Unoptimized programs compute values nobody reads, a debugger can find them in the struct
+    for (Op &op : program->ops) {
+        if (uses[op.result] == 0) storage->storage_class[op.result] = STORAGE_STATIC;
+    }
+    for (Op &op : program->ops) {
+        Term *terms = op_terms(program, &op);
+        for (u32 t = 0; t < op.term_count; t++) {
+            Value value = terms[t].value;
+            if (storage->storage_class[value] != STORAGE_LOCAL || uses[value] != 1) continue;
+            if (depth[value] + 1 > max_depth) continue;
+            storage->storage_class[value] = STORAGE_INLINE;
+            depth[op.result] = std::max(depth[op.result], depth[value] + 1);
+        }
+    }
+
+    Array<u32> last_use = {};  // by value, an op index or updates_index
+    array_reserve(&last_use, value_count);
+    for (Value v = 0; v < value_count; v++) array_add(&last_use, (u32)-1);
+    for (u32 i = 0; i < op_count; i++) {
+        Value result = program->ops[i].result;
+        if (storage->storage_class[result] == STORAGE_INLINE) continue;
+        last_use[result] = i;  // even if nothing reads it
+        for_each_read(storage, program, i, [&](Value value) { last_use[value] = i; });
+    }
+    for (Update &update : program->updates) last_use[update.source] = updates_index;
+
+    Array<u32> free_slots[2] = {};  // of doubles and of singles
+    auto pool = [&](Value value) { return &free_slots[program->value_precision[value] == PRECISION_SINGLE]; };
+    auto release = [&](Value value, u32 i) {
+        if (storage->storage_class[value] != STORAGE_LOCAL || last_use[value] != i) return;
+        array_add(pool(value), storage->slot[value]);
+        last_use[value] = (u32)-1;  // a value read twice by the op is released once
+    };
+
+    storage->slot_count = 0;
+    for (u32 i = 0; i < op_count; i++) {
+        Value result = program->ops[i].result;
+        if (storage->storage_class[result] == STORAGE_INLINE) continue;
+        for_each_read(storage, program, i, [&](Value value) { release(value, i); });
+
+        if (storage->storage_class[result] != STORAGE_LOCAL) continue;
+        Array<u32> *free = pool(result);
+        if (free->length != 0) {
+            storage->slot[result] = (*free)[free->length - 1];
+            free->length--;
+        } else {
+            storage->slot[result] = storage->slot_count++;
+            array_add(&storage->slot_precision, program->value_precision[result]);
+        }
+        release(result, i);
+    }
+
+    array_free(&uses);
+    array_free(&depth);
+    array_free(&last_use);
+    array_free(&free_slots[0]);
+    array_free(&free_slots[1]);
+}
@@ -6,6 +6,7 @@
 #include <string.h>
 #include <stdio.h>
 #include "types.h"
+#include "arena.hpp"
 
 struct str {
     char *data = NULL;
@@ -45,9 +46,16 @@ str str_copy(str self);
 #define str_add(...) str_add_array((str[]){__VA_ARGS__}, sizeof((str[]){__VA_ARGS__})/sizeof(str))
 str str_add_array(const str *items, u64 count);
 
+/* Same as above, but the result lives in the arena and must not be str_free'd. */
+str str_copy_known_length_arena(Arena *arena, const char *data, u64 length);
+str str_copy_arena(Arena *arena, str self);
+#define str_add_arena(arena, ...) str_add_array_arena((arena), (str[]){__VA_ARGS__}, sizeof((str[]){__VA_ARGS__})/sizeof(str))
+str str_add_array_arena(Arena *arena, const str *items, u64 count);
+
 int str_compare(str self, str other);
 
 bool str_startswith(str self, str other);
+bool str_endswith(str self, str other);
 
 /* Returns a slice */
 char *str_after_strip(char *pos, char *end, char to_strip);
@@ -59,6 +67,20 @@ str str_tokenize_whitespace(str *self);
 
 str read_entire_file(str file_path);
 
+/* Read-only view of a whole file. Regular files are mmap'ed, so every slice
+ * of `content` points straight into the page cache. Pipes, ttys and anything
+ * else that can't be mapped are read into a heap buffer instead.
+ * Content of a mapped file is NOT null-terminated.
+ * Pass "-" to read from stdin.
+ */
+struct File_View {
+    str content;
+    bool is_mapped;
+};
+
+File_View map_entire_file(str file_path);
+void file_view_free(File_View *view);
+
 str str_format_raw(u64 reserve_for_data, str format, ...);
 #define str_format(reserve_for_data, s, ...) \
     str_format_raw(reserve_for_data, str(s) __VA_OPT__(,) __VA_ARGS__)
@@ -68,7 +90,8 @@ void str_debug_fprint(str self, FILE *stream);
 #endif  // STR_H
 
 
-#ifdef STR_IMPLEMENT
+#if defined(STR_IMPLEMENT) && !defined(STR_IMPLEMENTED)
+#define STR_IMPLEMENTED
 
 #include <stdlib.h>
 #include <ctype.h>
@@ -154,6 +177,32 @@ str str_add_array(const str *items, u64 count) {
     return result;
 }
 
+str str_copy_known_length_arena(Arena *arena, const char *data, u64 length) {
+    char *copy = (char *)arena_alloc(arena, length + 1, 1);
+    memcpy(copy, data, length);
+    copy[length] = '\0';
+    return (str){copy, length};
+}
+
+str str_copy_arena(Arena *arena, str self) {
+    return str_copy_known_length_arena(arena, self.data, self.length);
+}
+
+str str_add_array_arena(Arena *arena, const str *items, u64 count) {
+    u64 len = 0;
+    for (u64 i = 0; i < count; i++) {
+        len += items[i].length;
+    }
+    str result = {(char *)arena_alloc(arena, len + 1, 1), len};
+    len = 0;
+    for (u64 i = 0; i < count; i++) {
+        memcpy(result.data + len, items[i].data, items[i].length);
+        len += items[i].length;
+    }
+    result.data[len] = 0;
+    return result;
+}
+
 int str_compare(str self, str other) {
     if (self.length < other.length) {
         return -1;
@@ -177,6 +226,13 @@ bool str_startswith(str self, str other) {
     return memcmp(self.data, other.data, other.length) == 0;
 }
 
+bool str_endswith(str self, str other) {
+    if (self.length < other.length) {
+        return false;
+    }
+    return memcmp(self.data + self.length - other.length, other.data, other.length) == 0;
+}
+
 char *str_after_strip(char *pos, char *end, char to_strip) {
     for (; pos < end; pos++) {
         if (*pos != to_strip) break;
@@ -273,6 +329,96 @@ str read_entire_file(str file_path) {
     return (str){cstr, fsize};
 }
 
+#if defined(__unix__) || defined(__APPLE__)
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+static str h_read_entire_fd(int fd) {
+    u64 capacity = 64 * 1024;
+    u64 length = 0;
+    char *data = (char *)malloc(capacity + 1);
+    assert((data != NULL) && "Buy more RAM lol!");
+
+    while (1) {
+        if (length == capacity) {
+            capacity *= 2;
+            data = (char *)realloc(data, capacity + 1);
+            assert((data != NULL) && "Buy more RAM lol!");
+        }
+        ssize_t got = read(fd, data + length, capacity - length);
+        if (got == 0) break;
+        if (got < 0 && errno == EINTR) continue;  // a signal came before any data
+        if (got < 0) {
+            free(data);
+            return str_NULL;
+        }
+        length += got;
+    }
+
+    data[length] = 0;
+    return (str){data, length};
+}
+
+File_View map_entire_file(str file_path) {
+    File_View view = {str_NULL, false};
+
+    bool is_stdin = file_path == str("-");
+    int fd = is_stdin? STDIN_FILENO : open(file_path.data, O_RDONLY);
+    if (fd < 0) {
+        fprintf(stderr, "Could not open file: " PRI_str "\n", FMT_str(file_path));
+        return view;
+    }
+
+    struct stat info;
+    bool can_map = fstat(fd, &info) == 0 && S_ISREG(info.st_mode) && info.st_size > 0;
+
+    if (can_map) {
+        void *data = mmap(NULL, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (data != MAP_FAILED) {
+            // The parser reads front to back exactly once
+            madvise(data, info.st_size, MADV_SEQUENTIAL);
+            view.content = (str){(char *)data, (u64)info.st_size};
+            view.is_mapped = true;
+        }
+    }
+
+    if (!view.is_mapped) {
+        view.content = h_read_entire_fd(fd);
+        if (view.content.data == NULL) {
+            fprintf(stderr, "Could not read file: " PRI_str "\n", FMT_str(file_path));
+        }
+    }
+
+    if (!is_stdin) close(fd);
+    return view;
+}
+
+void file_view_free(File_View *view) {
+    if (view->is_mapped) {
+        munmap(view->content.data, view->content.length);
+    } else {
+        free(view->content.data);
+    }
+    view->content = str_NULL;
+    view->is_mapped = false;
+}
+
+#else
+
+File_View map_entire_file(str file_path) {
+    return (File_View){read_entire_file(file_path), false};
+}
+
+void file_view_free(File_View *view) {
+    free(view->content.data);
+    view->content = str_NULL;
+}
+
+#endif
+
 str str_format_raw(u64 to_add, str format, ...) {
     u64 buffa_siz = format.length + to_add;
     char buffa[buffa_siz];
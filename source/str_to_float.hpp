@@ -0,0 +1,418 @@
+/* Correctly rounded decimal to f32/f64 conversion.
+ * Treats as much characters as a number as it can.
+ * Makes a slice to the string after the parsed number.
+ *
+ * Accepts [+-]digits[.digits][(e|E)[+-]digits], ".5", "5." and inf/infinity/nan.
+ *
+ * Exactly representable cases take Clinger's fast path, the rest go through
+ * the Eisel-Lemire algorithm with a 128-bit table of powers of five.
+ * Only the extremely rare inputs where Eisel-Lemire can't decide the rounding
+ * fall back to strtod/strtof on a copy of the number.
+ *
+ * SEE:
+ * https://arxiv.org/abs/2101.11408 (Number Parsing at a Gigabyte per Second)
+ * https://github.com/fastfloat/fast_float
+ * https://nigeltao.github.io/blog/2020/eisel-lemire.html
+ */
+
+#ifndef STR_TO_FLOAT_HPP
+#define STR_TO_FLOAT_HPP
+
+#include <type_traits>
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "types.h"
+#include "array.hpp"
+#include "arena.hpp"
+#include "str.hpp"
+#include "pow5_table.hpp"
+
+enum S2F_Result {
+    S2F_OK,
+    S2F_NOT_FOUND,
+    S2F_OUT_OF_RANGE,  // too big, the value is set to +-inf like strtod does
+};
+
+template <typename T>
+S2F_Result str_to_float_and_consume(str *string, T *value);
+
+template <typename T>
+S2F_Result str_to_float(str string, T *value) {
+    str temporary = string;
+    return str_to_float_and_consume(&temporary, value);
+}
+
+/* Parses "[a, b, c]" or a matrix "[a, b; c, d]" into `values` row by row.
+ * `columns` gets the row length, all rows must have the same one.
+ * The brackets are optional, so "a, b" or a single "a" work too. */
+template <typename T>
+S2F_Result str_to_float_list(str string, Array<T> *values, u64 *columns, Arena *arena);
+
+namespace s2f_detail {
+
+template <typename T> struct Format;
+
+template <> struct Format<f64> {
+    typedef u64 Bits;
+    static constexpr int mantissa_bits = 52;
+    static constexpr int minimum_exponent = -1023;
+    static constexpr int infinite_power = 0x7FF;
+    static constexpr int smallest_power_of_ten = -342;
+    static constexpr int largest_power_of_ten = 308;
+    static constexpr int min_exponent_round_to_even = -4;
+    static constexpr int max_exponent_round_to_even = 23;
+    static constexpr int max_exponent_fast_path = 22;
+    static constexpr u64 max_mantissa_fast_path = (u64)2 << 52;
+    static f64 exact_power_of_ten(int e) {
+        static const f64 powers[] = {
+            1e0,  1e1,  1e2,  1e3,  1e4,  1e5,  1e6,  1e7,  1e8,  1e9,  1e10, 1e11,
+            1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22,
+        };
+        return powers[e];
+    }
+    static f64 fallback(const char *cstr) { return strtod(cstr, NULL); }
+};
+
+template <> struct Format<f32> {
+    typedef u32 Bits;
+    static constexpr int mantissa_bits = 23;
+    static constexpr int minimum_exponent = -127;
+    static constexpr int infinite_power = 0xFF;
+    static constexpr int smallest_power_of_ten = -65;
+    static constexpr int largest_power_of_ten = 38;
+    static constexpr int min_exponent_round_to_even = -17;
+    static constexpr int max_exponent_round_to_even = 10;
+    static constexpr int max_exponent_fast_path = 10;
+    static constexpr u64 max_mantissa_fast_path = (u64)2 << 23;
+    static f32 exact_power_of_ten(int e) {
+        static const f32 powers[] = {1e0f, 1e1f, 1e2f, 1e3f, 1e4f, 1e5f, 1e6f, 1e7f, 1e8f, 1e9f, 1e10f};
+        return powers[e];
+    }
+    static f32 fallback(const char *cstr) { return strtof(cstr, NULL); }
+};
+
+struct Decimal {
+    u64 mantissa;       // first 19 significant digits
+    s64 exponent;       // value = mantissa * 10^exponent (before truncation)
+    bool negative;
+    bool truncated;     // nonzero digits after the first 19 were dropped
+    u64 length;         // characters consumed
+};
+
+static inline bool is_digit(char c) {
+    return (u8)(c - '0') < 10;
+}
+
+/* Returns false if there are no digits. */
+static bool parse_decimal(str string, Decimal *decimal) {
+    const char *p = string.data;
+    const char *end = string.data + string.length;
+    *decimal = (Decimal){0, 0, false, false, 0};
+
+    if (p < end && (*p == '-' || *p == '+')) {
+        decimal->negative = *p == '-';
+        p++;
+    }
+
+    u64 mantissa = 0;
+    int significant = 0;   // digits in `mantissa`, not counting leading zeros
+    s64 exponent = 0;
+    bool any_digit = false;
+
+    for (; p < end && is_digit(*p); p++) {
+        any_digit = true;
+        if (significant < 19) {
+            mantissa = mantissa * 10 + (*p - '0');
+            significant += mantissa != 0;
+        } else {
+            exponent++;
+            decimal->truncated |= *p != '0';
+        }
+    }
+
+    if (p < end && *p == '.') {
+        const char *dot = p++;
+        for (; p < end && is_digit(*p); p++) {
+            any_digit = true;
+            if (significant < 19) {
+                mantissa = mantissa * 10 + (*p - '0');
+                significant += mantissa != 0;
+                exponent--;
+            } else {
+                decimal->truncated |= *p != '0';
+            }
+        }
+        // "1." is a number, a lone "." is not
+        if (!any_digit) p = dot;
+    }
+
+    if (!any_digit) return false;
+
+    if (p < end && (*p == 'e' || *p == 'E')) {
+        const char *q = p + 1;
+        bool negative_exponent = false;
+        if (q < end && (*q == '-' || *q == '+')) {
+            negative_exponent = *q == '-';
+            q++;
+        }
+        if (q < end && is_digit(*q)) {
+            s64 explicit_exponent = 0;
+            for (; q < end && is_digit(*q); q++) {
+                // Anything this big is 0 or inf anyway, just don't overflow
+                if (explicit_exponent < 0x10000000) explicit_exponent = explicit_exponent * 10 + (*q - '0');
+            }
+            exponent += negative_exponent? -explicit_exponent : explicit_exponent;
+            p = q;
+        }
+        // otherwise the 'e' is not ours, like in "1else"
+    }
+
+    decimal->mantissa = mantissa;
+    decimal->exponent = exponent;
+    decimal->length = p - string.data;
+    return true;
+}
+
+static bool parse_special(str string, f64 *value, u64 *length) {
+    const char *p = string.data;
+    u64 left = string.length;
+    bool negative = false;
+    if (left && (*p == '-' || *p == '+')) {
+        negative = *p == '-';
+        p++;
+        left--;
+    }
+
+    if (left >= 3 && strncasecmp(p, "nan", 3) == 0) {
+        *value = negative? -__builtin_nan("") : __builtin_nan("");
+        *length = p + 3 - string.data;
+        return true;
+    }
+    if (left >= 3 && strncasecmp(p, "inf", 3) == 0) {
+        *value = negative? -__builtin_inf() : __builtin_inf();
+        bool long_form = left >= 8 && strncasecmp(p, "infinity", 8) == 0;
+        *length = p + (long_form? 8 : 3) - string.data;
+        return true;
+    }
+    return false;
+}
+
+struct Product {
+    u64 high;
+    u64 low;
+};
+
+static inline Product multiply(u64 a, u64 b) {
+    unsigned __int128 product = (unsigned __int128)a * b;
+    return (Product){(u64)(product >> 64), (u64)product};
+}
+
+/* floor(log2(10^q)) + 63 */
+static inline int binary_power(int q) {
+    return (((152170 + 65536) * q) >> 16) + 63;
+}
+
+/* Returns {mantissa, biased binary exponent},
+ * exponent -1 means the rounding can't be decided with 128 bits. */
+template <typename T>
+static Product eisel_lemire(s64 q, u64 w) {
+    typedef Format<T> F;
+    Product result = {0, 0};  // {mantissa, power2}
+
+    if (w == 0 || q < F::smallest_power_of_ten) return result;
+    if (q > F::largest_power_of_ten) {
+        result.low = F::infinite_power;
+        return result;
+    }
+
+    int lz = __builtin_clzll(w);
+    w <<= lz;
+
+    // Only as many bits as needed for the rounding decision
+    constexpr u64 precision_mask = ~(u64)0 >> (F::mantissa_bits + 3);
+    u64 index = 2 * (q - POW5_TABLE_MIN_EXPONENT);
+    Product product = multiply(w, pow5_table[index]);
+    if ((product.high & precision_mask) == precision_mask) {
+        Product second = multiply(w, pow5_table[index + 1]);
+        product.low += second.high;
+        if (second.high > product.low) product.high++;
+    }
+
+    // For q in [-27, 55] the table entry is exact, so the product is too
+    if (product.low == ~(u64)0 && (q < -27 || q > 55)) {
+        result.low = (u64)-1;
+        return result;
+    }
+
+    int upper_bit = (int)(product.high >> 63);
+    int shift = upper_bit + 64 - F::mantissa_bits - 3;
+    u64 mantissa = product.high >> shift;
+    s64 power2 = binary_power((int)q) + upper_bit - lz - F::minimum_exponent;
+
+    if (power2 <= 0) {
+        // Subnormal
+        if (-power2 + 1 >= 64) return result;
+        mantissa >>= -power2 + 1;
+        mantissa += mantissa & 1;
+        mantissa >>= 1;
+        result.high = mantissa;
+        result.low = mantissa < ((u64)1 << F::mantissa_bits)? 0 : 1;
+        return result;
+    }
+
+    // Exactly halfway between two floats, round to even instead of up
+    if (product.low <= 1 && q >= F::min_exponent_round_to_even && q <= F::max_exponent_round_to_even &&
+        (mantissa & 3) == 1 && (mantissa << shift) == product.high) {
+        mantissa &= ~(u64)1;
+    }
+
+    mantissa += mantissa & 1;
+    mantissa >>= 1;
+    if (mantissa >= ((u64)2 << F::mantissa_bits)) {
+        mantissa = (u64)1 << F::mantissa_bits;
+        power2++;
+    }
+    mantissa &= ~((u64)1 << F::mantissa_bits);
+
+    if (power2 >= F::infinite_power) {
+        result.low = F::infinite_power;
+        return result;
+    }
+    result.high = mantissa;
+    result.low = power2;
+    return result;
+}
+
+template <typename T>
+static T assemble(Product parts, bool negative) {
+    typedef typename Format<T>::Bits Bits;
+    Bits bits = (Bits)parts.high | ((Bits)parts.low << Format<T>::mantissa_bits);
+    if (negative) bits |= (Bits)1 << (sizeof(Bits) * 8 - 1);
+    T value;
+    memcpy(&value, &bits, sizeof(value));
+    return value;
+}
+
+template <typename T>
+static T slow_path(str number) {
+    // The whole number, a halfway case can be decided by a digit some 770 places
+    // in, and an exponent after a cut would be lost. Long ones go on the heap
+    char buffer[128];
+    char *cstr = number.length < sizeof(buffer)? buffer : (char *)malloc(number.length + 1);
+    assert((cstr != NULL) && "Buy more RAM lol!");
+    memcpy(cstr, number.data, number.length);
+    cstr[number.length] = '\0';
+    T value = Format<T>::fallback(cstr);
+    if (cstr != buffer) free(cstr);
+    return value;
+}
+
+} // namespace s2f_detail
+
+template <typename T>
+S2F_Result str_to_float_and_consume(str *string, T *value) {
+    static_assert(std::is_same<T, f32>::value || std::is_same<T, f64>::value, "T must be f32 or f64");
+    using namespace s2f_detail;
+    typedef Format<T> F;
+
+    Decimal decimal;
+    if (!parse_decimal(*string, &decimal)) {
+        f64 special;
+        u64 length;
+        if (!parse_special(*string, &special, &length)) return S2F_NOT_FOUND;
+        *value = (T)special;
+        string->data += length;
+        string->length -= length;
+        return S2F_OK;
+    }
+
+    str number = {string->data, decimal.length};
+    T result;
+
+    if (!decimal.truncated && decimal.mantissa <= F::max_mantissa_fast_path &&
+        decimal.exponent >= -F::max_exponent_fast_path && decimal.exponent <= F::max_exponent_fast_path) {
+        // Clinger: both operands are exact, so is the single rounding
+        result = (T)decimal.mantissa;
+        if (decimal.exponent < 0) {
+            result = result / F::exact_power_of_ten(-decimal.exponent);
+        } else {
+            result = result * F::exact_power_of_ten(decimal.exponent);
+        }
+        if (decimal.negative) result = -result;
+    } else {
+        Product parts = eisel_lemire<T>(decimal.exponent, decimal.mantissa);
+        bool decided = parts.low != (u64)-1;
+        if (decided && decimal.truncated) {
+            // The real mantissa is somewhere between w and w+1
+            Product upper = eisel_lemire<T>(decimal.exponent, decimal.mantissa + 1);
+            decided = upper.low == parts.low && upper.high == parts.high;
+        }
+        result = decided? assemble<T>(parts, decimal.negative) : slow_path<T>(number);
+    }
+
+    *value = result;
+    string->data += decimal.length;
+    string->length -= decimal.length;
+
+    if (__builtin_isinf(result)) return S2F_OUT_OF_RANGE;
+    return S2F_OK;
+}
+
+template <typename T>
+S2F_Result str_to_float_list(str string, Array<T> *values, u64 *columns, Arena *arena) {
+    char *pos = str_after_whitespace_strip(string.data, string.data + string.length);
+    char *end = string.data + string.length;
+
+    bool bracketed = pos < end && *pos == '[';
+    if (bracketed) pos++;
+
+    u64 row_length = 0;
+    u64 first_row_length = 0;
+    bool first_row = true;
+    S2F_Result result = S2F_OK;
+
+    pos = str_after_whitespace_strip(pos, end);
+    bool empty = bracketed && pos < end && *pos == ']';  // "[]"
+
+    while (!empty) {
+        pos = str_after_whitespace_strip(pos, end);
+        str rest = {pos, (u64)(end - pos)};
+        T value;
+        S2F_Result parsed = str_to_float_and_consume(&rest, &value);
+        if (parsed == S2F_NOT_FOUND) return S2F_NOT_FOUND;
+        if (parsed == S2F_OUT_OF_RANGE) result = S2F_OUT_OF_RANGE;
+        array_add(values, value, arena);
+        row_length++;
+        pos = str_after_whitespace_strip(rest.data, end);
+
+        if (pos < end && *pos == ',') {
+            pos++;
+            continue;
+        }
+        if (first_row) {
+            first_row_length = row_length;
+            first_row = false;
+        } else if (row_length != first_row_length) {
+            return S2F_NOT_FOUND;  // ragged matrix
+        }
+        row_length = 0;
+        if (pos < end && *pos == ';') {
+            pos++;
+            continue;
+        }
+        break;
+    }
+
+    if (bracketed) {
+        if (pos >= end || *pos != ']') return S2F_NOT_FOUND;
+        pos++;
+    }
+    if (str_after_whitespace_strip(pos, end) != end) return S2F_NOT_FOUND;
+
+    *columns = first_row_length;
+    return result;
+}
+
+#endif // STR_TO_FLOAT_HPP
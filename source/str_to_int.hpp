@@ -1,9 +1,17 @@
 /* Treats as much characters as digits as it can.
  * Makes a slice to the string after the parsed integer. */
 
+#ifndef STR_TO_INT_HPP
+#define STR_TO_INT_HPP
+
 #include <type_traits>
 #include <limits>
 #include <cstdint>
+#include <string.h>
+#include <assert.h>
+
+#include "types.h"
+#include "str.hpp"
 
 enum S2I_Result {
     S2I_OK,
@@ -11,93 +19,156 @@ enum S2I_Result {
     S2I_OUT_OF_RANGE
 };
 
-/* TODO: ignore leading zeros,
- * TODO: except leading 0b, 0o and 0x.
-
- * TODO: Allow to pass in a target base.
+/* Leading zeros are just zeros, there is no implicit octal.
+ *
+ * With base 0 the base comes from the prefix: 0b, 0o or 0x (any case),
+ * otherwise it is 10. An explicit base still accepts its own prefix.
+ * A prefix without a valid digit after it is not a prefix ("0xg" is 0).
 
- * TODO: Allow single underscores in the number
- * (except the first, last and characteres right after 0b,0o,0x).
- * Not allowed: _234, 456_, 0x_F, 0xF_
+ * Single underscores are allowed between digits.
+ * Not allowed: _234, 456_, 0x_F, 0xF_, 1__0
  * Allowed: 2_3_4, 0xF_A
+ * A disallowed underscore ends the number, like any other non-digit.
+ *
+ * Base 10 goes through 8 digits at a time (SWAR) with one overflow check per chunk.
  */
 
 /* SEE:
  * https://github.com/lattera/glibc/blob/895ef79e04a953cac1493863bcae29ad85657ee1/stdlib/strtol_l.c
  * https://github.com/python/cpython/blob/6557af669899f18f8d123f8e1b6c3380d502c519/Objects/longobject.c#L2518
+ * https://lemire.me/blog/2022/01/21/swar-explained-parsing-eight-digits/
  */
 
 template <typename T>
-S2I_Result str_to_int_and_consume(str *string, T *value);
+S2I_Result str_to_int_and_consume(str *string, T *value, u8 base = 0);
 
 template <typename T>
-S2I_Result str_to_int(str string, T *value) {
+S2I_Result str_to_int(str string, T *value, u8 base = 0) {
     str temporary = string;
-    return str_to_int_and_consume(&temporary, value);
+    return str_to_int_and_consume(&temporary, value, base);
+}
+
+namespace s2i_detail {
+
+/* 0-9, a-z and A-Z as 10-35, everything else is 255 */
+static inline u8 digit_value(char c) {
+    if (c >= '0' && c <= '9') return c - '0';
+    u8 lower = c | 0x20;
+    if (lower >= 'a' && lower <= 'z') return lower - 'a' + 10;
+    return 255;
+}
+
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+#define S2I_SWAR 1
+
+static inline bool is_eight_digits(u64 chunk) {
+    return (((chunk & 0xF0F0F0F0F0F0F0F0) |
+             (((chunk + 0x0606060606060606) & 0xF0F0F0F0F0F0F0F0) >> 4)) == 0x3333333333333333);
+}
+
+/* First character is in the lowest byte */
+static inline u32 parse_eight_digits(u64 chunk) {
+    const u64 mask = 0x000000FF000000FF;
+    const u64 mul1 = 100 + (1000000ull << 32);
+    const u64 mul2 = 1 + (10000ull << 32);
+    chunk -= 0x3030303030303030;
+    chunk = (chunk * 10) + (chunk >> 8);  // pairs of digits
+    chunk = (((chunk & mask) * mul1) + (((chunk >> 16) & mask) * mul2)) >> 32;
+    return (u32)chunk;
 }
+#endif
+
+} // namespace s2i_detail
 
 template <typename T>
-S2I_Result str_to_int_and_consume(str *string, T *value) {
+S2I_Result str_to_int_and_consume(str *string, T *value, u8 base) {
     static_assert(std::is_integral<T>::value, "T must be an integer type");
+    static_assert(sizeof(T) <= sizeof(u64), "T must fit into 64 bits");
+    assert((base == 0 || (base >= 2 && base <= 36)) && "base must be 0 or in [2, 36]");
+    using s2i_detail::digit_value;
 
-    str temp_str = *string;
+    const char *data = string->data;
+    u64 length = string->length;
 
-    if (temp_str.length == 0) {
+    if (length == 0) {
         return S2I_NOT_FOUND;
     }
 
     bool is_negative = false;
-    size_t consumed_prefix = 0;
+    u64 i = 0;
 
     if (std::is_signed<T>::value) {
-        if (temp_str.data[0] == '-') {
+        if (data[0] == '-') {
             is_negative = true;
-            consumed_prefix = 1;
-        } else if (temp_str.data[0] == '+') {
-            consumed_prefix = 1;
+            i = 1;
+        } else if (data[0] == '+') {
+            i = 1;
         }
     }
 
     // String with only a sign, or an empty string for unsigned, is not a valid number.
-    if (temp_str.length <= consumed_prefix) {
+    if (length <= i) {
         return S2I_NOT_FOUND;
     }
 
-    bool found_digit = false;
-    T result = 0;
-
-    size_t i = consumed_prefix;
-    for (; i < temp_str.length; ++i) {
-        char c = temp_str.data[i];
-        if (c < '0' || c > '9') {
-            break;
+    if (i + 2 < length && data[i] == '0') {
+        u8 letter = data[i + 1] | 0x20;
+        u8 prefix_base = letter == 'b'? 2 : letter == 'o'? 8 : letter == 'x'? 16 : 0;
+        if (prefix_base && (base == 0 || base == prefix_base) && digit_value(data[i + 2]) < prefix_base) {
+            base = prefix_base;
+            i += 2;
+        }
+    }
+    if (base == 0) base = 10;
+
+    // Accumulate the magnitude, the sign is applied at the end
+    const u64 limit = is_negative? (u64)std::numeric_limits<T>::max() + 1 : (u64)std::numeric_limits<T>::max();
+    u64 magnitude = 0;
+    bool overflow = false;
+    const u64 digits_start = i;
+
+#ifdef S2I_SWAR
+    if (base == 10) {
+        while (i + 8 <= length) {
+            u64 chunk;
+            memcpy(&chunk, data + i, sizeof(chunk));
+            if (!s2i_detail::is_eight_digits(chunk)) break;
+            overflow |= __builtin_mul_overflow(magnitude, (u64)100000000, &magnitude);
+            overflow |= __builtin_add_overflow(magnitude, (u64)s2i_detail::parse_eight_digits(chunk), &magnitude);
+            i += 8;
+        }
+    }
+#endif
+
+    for (; i < length; i++) {
+        char c = data[i];
+        if (c == '_') {
+            bool between_digits = i > digits_start && i + 1 < length && digit_value(data[i + 1]) < base;
+            if (!between_digits) break;
+            continue;
         }
 
-        found_digit = true;
-        uint8_t digit = c - '0';
-
-        if (is_negative) {
-            constexpr T min_val = std::numeric_limits<T>::min();
-            if (result < min_val / 10 || (result == min_val / 10 && static_cast<T>(-digit) < min_val % 10)) {
-                return S2I_OUT_OF_RANGE;
-            }
-            result = result * 10 - digit;
-        } else {
-            constexpr T max_val = std::numeric_limits<T>::max();
-            if (result > max_val / 10 || (result == max_val / 10 && static_cast<T>(digit) > max_val % 10)) {
-                return S2I_OUT_OF_RANGE;
-            }
-            result = result * 10 + digit;
+        u8 digit = digit_value(c);
+        if (digit >= base) {
+            break;
         }
+        overflow |= __builtin_mul_overflow(magnitude, (u64)base, &magnitude);
+        overflow |= __builtin_add_overflow(magnitude, (u64)digit, &magnitude);
     }
 
-    if (!found_digit) {
+    if (i == digits_start) {
         return S2I_NOT_FOUND;
     }
 
-    *value = result;
+    if (overflow || magnitude > limit) {
+        return S2I_OUT_OF_RANGE;
+    }
+
+    *value = is_negative? (T)(0 - magnitude) : (T)magnitude;
     string->data += i;
     string->length -= i;
 
     return S2I_OK;
 }
+
+#endif // STR_TO_INT_HPP
@@ -0,0 +1,190 @@
+/*
+ * xml_index.hpp - structural index for the XML parser, in the spirit of simdjson's stage 1.
+ *
+ * Finds every '<', '>', '"', '=' and '/' 16 (SSE2) or 32 (AVX2) bytes at a time
+ * and records their offsets, so the parser jumps from one structural character
+ * to the next instead of looking at every byte of whitespace and text.
+ *
+ * The index is built lazily in fixed windows of the input,
+ * so its memory stays bounded no matter how big the model is.
+ *
+ * Characters inside attribute values or text are indexed too,
+ * it's up to the parser to skip them (e.g. a value ends at the next '"').
+ */
+
+#ifndef XML_INDEX_HPP
+#define XML_INDEX_HPP
+
+#include "types.h"
+#include "array.hpp"
+#include "str.hpp"
+
+#if defined(__x86_64__) || defined(_M_X64)
+#define XML_INDEX_X86 1
+#include <immintrin.h>
+#endif
+
+#define XML_INDEX_WINDOW (64 * 1024)
+
+struct Xml_Index {
+    str input;
+    u64 window_start = 0;   // offset of the indexed window in the input
+    u64 window_end = 0;     // everything before it is already indexed
+    Array<u32> positions;   // relative to window_start
+    u64 cursor = 0;         // first entry that was not handed out yet
+};
+
+void xml_index_init(Xml_Index *index, str input) {
+    index->input = input;
+    index->window_start = 0;
+    index->window_end = 0;
+    index->positions.length = 0;
+    index->cursor = 0;
+}
+
+void xml_index_free(Xml_Index *index) {
+    array_free(&index->positions);
+}
+
+namespace xml_index_detail {
+
+static inline bool is_structural(char c) {
+    return c == '<' || c == '>' || c == '"' || c == '=' || c == '/';
+}
+
+static inline int count_trailing_zeros(u32 mask) {
+    return __builtin_ctz(mask);
+}
+
+/* Appends the offsets of set bits in the mask.
+ * The caller reserved enough space for the whole chunk. */
+static inline void flush_mask(Array<u32> *out, u32 offset, u32 mask) {
+    u32 *write = out->data + out->length;
+    out->length += __builtin_popcount(mask);
+    while (mask) {
+        *write++ = offset + count_trailing_zeros(mask);
+        mask &= mask - 1;
+    }
+}
+
+#ifndef XML_INDEX_X86
+
+static void index_scalar(const char *data, u32 length, Array<u32> *out) {
+    array_reserve_to_add(out, length);
+    for (u32 i = 0; i < length; i++) {
+        if (is_structural(data[i])) {
+            out->data[out->length++] = i;
+        }
+    }
+}
+
+#else
+
+/* '<', '=' and '>' are 0x3C, 0x3D and 0x3E,
+ * so they are found with one subtract and an unsigned compare. */
+
+static void index_sse2(const char *data, u32 length, Array<u32> *out) {
+    array_reserve_to_add(out, length);
+
+    const __m128i angle_base = _mm_set1_epi8('<');
+    const __m128i angle_span = _mm_set1_epi8(2);
+    const __m128i quote = _mm_set1_epi8('"');
+    const __m128i slash = _mm_set1_epi8('/');
+
+    u32 i = 0;
+    for (; i + 16 <= length; i += 16) {
+        __m128i chunk = _mm_loadu_si128((const __m128i *)(data + i));
+        __m128i shifted = _mm_sub_epi8(chunk, angle_base);
+        __m128i angles = _mm_cmpeq_epi8(_mm_min_epu8(shifted, angle_span), shifted);
+        __m128i others = _mm_or_si128(_mm_cmpeq_epi8(chunk, quote), _mm_cmpeq_epi8(chunk, slash));
+        u32 mask = _mm_movemask_epi8(_mm_or_si128(angles, others));
+        flush_mask(out, i, mask);
+    }
+
+    for (; i < length; i++) {
+        if (is_structural(data[i])) {
+            out->data[out->length++] = i;
+        }
+    }
+}
+
+__attribute__((target("avx2")))
+static void index_avx2(const char *data, u32 length, Array<u32> *out) {
+    array_reserve_to_add(out, length);
+
+    const __m256i angle_base = _mm256_set1_epi8('<');
+    const __m256i angle_span = _mm256_set1_epi8(2);
+    const __m256i quote = _mm256_set1_epi8('"');
+    const __m256i slash = _mm256_set1_epi8('/');
+
+    u32 i = 0;
+    for (; i + 32 <= length; i += 32) {
+        __m256i chunk = _mm256_loadu_si256((const __m256i *)(data + i));
+        __m256i shifted = _mm256_sub_epi8(chunk, angle_base);
+        __m256i angles = _mm256_cmpeq_epi8(_mm256_min_epu8(shifted, angle_span), shifted);
+        __m256i others = _mm256_or_si256(_mm256_cmpeq_epi8(chunk, quote), _mm256_cmpeq_epi8(chunk, slash));
+        u32 mask = _mm256_movemask_epi8(_mm256_or_si256(angles, others));
+        flush_mask(out, i, mask);
+    }
+
+    for (; i < length; i++) {
+        if (is_structural(data[i])) {
+            out->data[out->length++] = i;
+        }
+    }
+}
+
+#endif  // XML_INDEX_X86
+
+typedef void (*Index_Function)(const char *data, u32 length, Array<u32> *out);
+
+static Index_Function pick_index_function() {
+#ifdef XML_INDEX_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) return index_avx2;
+    return index_sse2;
+#else
+    return index_scalar;
+#endif
+}
+
+static Index_Function index_function = pick_index_function();
+
+} // namespace xml_index_detail
+
+/* Returns the first structural character at or after `from`, or NULL at the end of input. */
+char *xml_index_next(Xml_Index *index, char *from) {
+    u64 from_offset = from - index->input.data;
+
+    while (1) {
+        while (index->cursor < index->positions.length) {
+            u64 offset = index->window_start + index->positions.data[index->cursor];
+            if (offset >= from_offset) return index->input.data + offset;
+            index->cursor++;
+        }
+
+        if (index->window_end >= index->input.length) return NULL;
+
+        u64 start = index->window_end > from_offset? index->window_end : from_offset;
+        if (start >= index->input.length) return NULL;
+        u64 length = index->input.length - start;
+        if (length > XML_INDEX_WINDOW) length = XML_INDEX_WINDOW;
+
+        index->window_start = start;
+        index->window_end = start + length;
+        index->positions.length = 0;
+        index->cursor = 0;
+        xml_index_detail::index_function(index->input.data + start, (u32)length, &index->positions);
+    }
+}
+
+/* Returns the first `c` at or after `from`, or NULL. `c` must be structural. */
+char *xml_index_find(Xml_Index *index, char *from, char c) {
+    char *pos = xml_index_next(index, from);
+    while (pos != NULL && *pos != c) {
+        pos = xml_index_next(index, pos + 1);
+    }
+    return pos;
+}
+
+#endif // XML_INDEX_HPP
@@ -0,0 +1,142 @@
+/* Steps a generated model like `algraph --simulate N` does: every line of stdin
+ * sets the Inports of one step in the order of their names, an empty line or
+ * the end of the input keeps them, and the Outports are printed after each
+ * step. Values are printed with 17 digits so they read back exactly.
+ *
+ *     ./model N < inputs.txt
+ *
+ * Built with -DNWOCG_RUN_REENTRANT and -DNWOCG_RUN_HEADER='"model.h"' it
+ * drives one nwocg_state of --reentrant code instead. With -DNWOCG_RUN_BATCH
+ * it drives the instance given after N of --batch code. The others get NaN
+ * inputs, so they show up in its output if their values overlap.
+ *
+ * With -DNWOCG_RUN_FIXED it drives --fixed-point code, rounding the inputs to
+ * the formats of their Inports, saturated, and printing the real values of the
+ * Outports. `./model lsb` prints the resolution of each Outport's format.
+ */
+#if defined(NWOCG_RUN_REENTRANT) || defined(NWOCG_RUN_BATCH)
+#include NWOCG_RUN_HEADER
+#else
+#include "nwocg_run.h"
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <math.h>
+
+#if defined(NWOCG_RUN_REENTRANT)
+typedef nwocg_StatePort Port;
+static nwocg_state state;
+#define ports nwocg_generated_state_ports
+static double *port_value(const Port *port) { return (double *)((char *)&state + port->offset); }
+static double output(const Port *port) { return *port_value(port); }
+static void set_input(const Port *port, double value) { *port_value(port) = value; }
+static void init(void) { nwocg_generated_init_state(&state); }
+static void step(void) { nwocg_generated_step_state(&state); }
+#elif defined(NWOCG_RUN_BATCH)
+typedef nwocg_ExtPort Port;
+static size_t instance;
+#define ports nwocg_generated_ext_ports
+static double output(const Port *port) { return *nwocg_generated_instance(port, instance); }
+static void set_input(const Port *port, double value)
+{
+    // The others last, so one sharing its place overwrites it
+    *nwocg_generated_instance(port, instance) = value;
+    for (size_t i = 0; i < nwocg_generated_batch; i++) {
+        if (i != instance) *nwocg_generated_instance(port, i) = NAN;
+    }
+}
+static void init(void) { nwocg_generated_init(); }
+static void step(void) { nwocg_generated_step(); }
+#elif defined(NWOCG_RUN_FIXED)
+typedef nwocg_FixedPort Port;
+#define ports nwocg_generated_fixed_ports
+static double output(const Port *port) { return ldexp(*port->value, -port->frac_bits); }
+static void set_input(const Port *port, double value)
+{
+    double scaled = round(ldexp(value, port->frac_bits));
+    *port->value = scaled >= INT32_MAX? INT32_MAX : scaled <= INT32_MIN? INT32_MIN : (int32_t)scaled;
+}
+static void init(void) { nwocg_generated_init(); }
+static void step(void) { nwocg_generated_step(); }
+#else
+typedef nwocg_ExtPort Port;
+#define ports nwocg_generated_ext_ports
+static double output(const Port *port) { return *port->value; }
+static void set_input(const Port *port, double value) { *port->value = value; }
+static void init(void) { nwocg_generated_init(); }
+static void step(void) { nwocg_generated_step(); }
+#endif
+
+int main(int argc, char **argv)
+{
+#ifdef NWOCG_RUN_BATCH
+    long steps = argc == 3? strtol(argv[1], NULL, 10) : 0;
+    instance = argc == 3? strtoul(argv[2], NULL, 10) : 0;
+    if (steps <= 0 || instance >= nwocg_generated_batch) {
+        fprintf(stderr, "Usage: %s STEPS INSTANCE < inputs.txt\n", argv[0]);
+        return 1;
+    }
+#else
+#ifdef NWOCG_RUN_FIXED
+    if (argc == 2 && strcmp(argv[1], "lsb") == 0) {
+        const char *separator = "";
+        for (const Port *port = ports; port->name != NULL; port++) {
+            if (port->is_input) continue;
+            printf("%s%.17g", separator, ldexp(1, -port->frac_bits));
+            separator = " ";
+        }
+        printf("\n");
+        return 0;
+    }
+#endif
+    long steps = argc == 2? strtol(argv[1], NULL, 10) : 0;
+    if (steps <= 0) {
+        fprintf(stderr, "Usage: %s STEPS < inputs.txt\n", argv[0]);
+        return 1;
+    }
+#endif
+
+    const char *separator = "";
+    for (const Port *port = ports; port->name != NULL; port++) {
+        if (port->is_input) continue;
+        printf("%s%s", separator, port->name);
+        separator = " ";
+    }
+    printf("\n");
+
+    init();
+    char line[4096];
+    int has_input = 1;
+    for (long s = 1; s <= steps; s++) {
+        has_input = has_input && fgets(line, sizeof(line), stdin) != NULL;
+        char *values = has_input? line : "";
+        while (isspace((unsigned char)*values)) values++;
+        for (const Port *port = ports; port->name != NULL && *values != '\0'; port++) {
+            if (!port->is_input) continue;
+            char *end;
+            set_input(port, strtod(values, &end));
+            if (end == values) {
+                fprintf(stderr, "ERROR: line %ld has no number for Inport %s\n", s, port->name);
+                return 1;
+            }
+            values = end;
+            while (isspace((unsigned char)*values)) values++;
+        }
+        if (*values != '\0') {
+            fprintf(stderr, "ERROR: line %ld has more values than there are Inports\n", s);
+            return 1;
+        }
+
+        step();
+        separator = "";
+        for (const Port *port = ports; port->name != NULL; port++) {
+            if (port->is_input) continue;
+            printf("%s%.17g", separator, output(port));
+            separator = " ";
+        }
+        printf("\n");
+    }
+    return 0;
+}
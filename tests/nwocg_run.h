@@ -0,0 +1,34 @@
+/* The runtime interface the generated C is compiled against, enough of it to
+ * step a model from nwocg_run.c in the tests. */
+#ifndef NWOCG_RUN_H
+#define NWOCG_RUN_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+typedef struct
+{
+    const char *name;
+    double *value;
+    int is_input;
+} nwocg_ExtPort;
+
+extern const nwocg_ExtPort * const nwocg_generated_ext_ports;
+extern const size_t                nwocg_generated_ext_ports_size;
+
+/* --fixed-point code defines this itself, without including this header. The
+ * real value is *value * 2^-frac_bits. */
+typedef struct
+{
+    const char *name;
+    int32_t *value;
+    int frac_bits;
+    int is_input;
+} nwocg_FixedPort;
+
+extern const nwocg_FixedPort * const nwocg_generated_fixed_ports;
+
+void nwocg_generated_init(void);
+void nwocg_generated_step(void);
+
+#endif // NWOCG_RUN_H